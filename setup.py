@@ -11,7 +11,8 @@ pylcb_ext = Extension(
     ],
     libraries=[
         'couchbase',
-        'event'
+        'event',
+        'z'
     ],
 )
 
@@ -1,2 +1,8 @@
 from .couchbase import Couchbase, PycbException
 from .couchbase import PycbKeyNotFound, PycbKeyExists
+from .couchbase import Transcoder, FMT_PICKLE, FMT_JSON, FMT_BYTES, FMT_UTF8
+from .reactor import AsyncioReactor, TornadoReactor, SharedEventBase
+from .pool import ConnectionPool
+from .singleflight import SingleFlight
+from .batching import AutoBatcher
+from .writebehind import WriteBehind
@@ -0,0 +1,208 @@
+import threading
+import time
+
+import pylcb
+
+from .couchbase import PycbException, LCB_ERROR, _get_value, _store_value
+
+
+class _Operation(object):
+    def __init__(self, key, command=None, operation=None):
+        self.key = key
+        self.command = command      # (key, expiration, flags, value)
+        self.operation = operation  # None for a get
+        self.done = threading.Event()
+        self.result = None
+        self.exception = None
+
+
+class AutoBatcher(object):
+    """
+    Sends single gets and stores issued concurrently as one multi-key
+    lcb_get and lcb_store per operation type, with a single wait.
+
+    The first caller to submit becomes the leader of a batch: it waits
+    up to window seconds, or until maxBatch operations are queued, then
+    sends everything queued.  A leader with no other caller in the
+    batcher sends its operation at once.  Callers submitting meanwhile
+    wait for the leader and get their own result, exactly what the
+    equivalent Bucket method would have returned or raised.
+
+    A batcher is shared by all connections of a Couchbase object to one
+    bucket, pooled or not.  Batches are sent one at a time on a
+    connection of the batcher's own, made by factory when the first
+    batch is sent and again after it failed, so no connection is used by
+    two threads.  Values are encoded with the transcoder and compression
+    that factory sets up; a connection given another one with
+    set_transcoder or set_compression is no longer batched.
+
+    A batched store drops the key from the near and miss caches of the
+    connection it was issued on, when it is queued and once it is done,
+    so that connection reads its own writes.  Gets of a connection with
+    one of those caches are not batched.  Other connections see a
+    batched write like one of any other client, once their cache entry
+    expires.
+    """
+
+    def __init__(self, factory, window=0.0005, maxBatch=64):
+        self.factory = factory
+        self.window = window
+        self.maxBatch = maxBatch
+        self.bucket = None      # the connection batches are sent on
+
+        self.lock = threading.Condition()
+        self.sending = threading.Lock()
+        self.pending = []       # operations not sent yet
+        self.leading = False    # a leader is collecting pending
+        self.active = 0         # callers inside _submit
+        self.batches = 0
+        self.operations = 0
+
+    def get(self, key):
+        return self._submit(_Operation(key))
+
+    def store(self, bucket, key, expiration, flags, value, operation):
+        # bucket must not answer from its caches with the value this
+        # write replaces, neither while it is queued nor after
+        pylcb.forget_cached(bucket.instance, key)
+        try:
+            return self._submit(_Operation(
+                key, (key, expiration, flags, value), operation))
+        finally:
+            pylcb.forget_cached(bucket.instance, key)
+
+    def stats(self):
+        with self.lock:
+            return dict(batches=self.batches, operations=self.operations,
+                        batch_size=float(self.operations) /
+                        (self.batches or 1))
+
+    def _submit(self, operation):
+        with self.lock:
+            self.active += 1
+            self.pending.append(operation)
+            leader = not self.leading
+            if leader:
+                self.leading = True
+                deadline = time.time() + self.window
+                # alone, there is nobody to wait for
+                while len(self.pending) < self.maxBatch and self.active > 1:
+                    remaining = deadline - time.time()
+                    if remaining <= 0:
+                        break
+                    self.lock.wait(remaining)
+            elif len(self.pending) >= self.maxBatch:
+                self.lock.notify_all()
+
+        try:
+            if leader:
+                # one batch at a time on the connection; operations queued
+                # while the previous one is sent join this one
+                with self.sending:
+                    with self.lock:
+                        batch = self.pending
+                        self.pending = []
+                        self.leading = False
+                        self.batches += 1
+                        self.operations += len(batch)
+                    self._send(batch)
+            else:
+                operation.done.wait()
+        finally:
+            with self.lock:
+                self.active -= 1
+
+        if operation.exception is not None:
+            raise operation.exception
+        return operation.result
+
+    def _send(self, batch):
+        try:
+            if self.bucket is None:
+                self.bucket = self.factory()
+            self._execute(self.bucket, batch)
+        except Exception as e:
+            # the connection failed.  Whatever is in flight completes
+            # before it is dropped, the next batch makes a new one
+            if self.bucket is not None:
+                try:
+                    pylcb.wait(self.bucket.instance)
+                except Exception:
+                    pass
+                self.bucket = None
+            for queued in batch:
+                if queued.result is None and queued.exception is None:
+                    queued.exception = e
+        finally:
+            for queued in batch:
+                queued.done.set()
+
+    def _execute(self, bucket, batch):
+        gets = []
+        stores = {}
+        for operation in batch:
+            if operation.operation is None:
+                gets.append(operation)
+            else:
+                stores.setdefault(operation.operation, []).append(operation)
+
+        # every response is collected in a list; responses for the same
+        # key arrive in the order they were sent
+        scheduled = []
+        if gets:
+            results = []
+            self._schedule(gets, lambda: pylcb.get_multi(
+                bucket.instance, results,
+                [operation.key for operation in gets]),
+                lambda operation: pylcb.get(
+                    bucket.instance, results, operation.key))
+            scheduled.append((gets, results, _get_value, "get_callback"))
+
+        for storeOperation, operations in stores.iteritems():
+            results = []
+            self._schedule(operations, lambda: pylcb.store_multi(
+                bucket.instance, results,
+                [operation.command for operation in operations],
+                storeOperation),
+                lambda operation: pylcb.store(
+                    bucket.instance, results, *(operation.command +
+                                                (storeOperation,))))
+            scheduled.append((operations, results, _store_value,
+                              "store_callback"))
+
+        bucket._wait()
+
+        for operations, results, interpret, callbackName in scheduled:
+            self._deliver(operations, results, interpret, callbackName)
+
+    def _schedule(self, operations, multi, single):
+        # a command the multi call rejects, say a value that can not be
+        # encoded, only fails its own operation
+        try:
+            multi()
+        except Exception:
+            for operation in operations:
+                try:
+                    single(operation)
+                except Exception as e:
+                    operation.exception = e
+
+    def _deliver(self, operations, results, interpret, callbackName):
+        byKey = {}
+        for result in results:
+            byKey.setdefault(result.key, []).append(result)
+
+        for operation in operations:
+            if operation.exception is not None:
+                continue
+            responses = byKey.get(operation.key)
+            if not responses:
+                errMsg = "did not get %s" % callbackName
+                operation.exception = PycbException(LCB_ERROR, errMsg)
+                continue
+
+            value = interpret(responses.pop(0))
+            if isinstance(value, PycbException):
+                operation.exception = value
+            else:
+                operation.result = value
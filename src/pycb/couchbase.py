@@ -1,13 +1,17 @@
 import pylcb
 import urllib
 import json
+import sys
+import threading
 import time
 
 # libcouchbase result codes
 LCB_SUCCESS = 0x00
 LCB_ERROR = 0x0a
+LCB_ETMPFAIL = 0x0b
 LCB_KEY_EEXISTS = 0x0c
 LCB_KEY_ENOENT = 0x0d
+LCB_NETWORK_ERROR = 0x10
 LCB_ETIMEDOUT = 0x17
 
 # libcouchbase create types
@@ -26,6 +30,21 @@ LCB_CONFIGURATION_NEW = 0x00,
 LCB_CONFIGURATION_CHANGED = 0x01,
 LCB_CONFIGURATION_UNCHANGED = 0x02
 
+# value formats kept by the transcoder in the top byte of the item flags
+FMT_MASK = 0xff000000
+FMT_LEGACY = 0x00000000     # no format, digit strings are read as ints
+FMT_PICKLE = 0x01000000
+FMT_JSON = 0x02000000
+FMT_BYTES = 0x03000000
+FMT_UTF8 = 0x04000000
+FMT_ZLIB = 0x80000000       # compressed, on top of the format
+
+# libcouchbase observe states
+LCB_OBSERVE_FOUND = 0x00
+LCB_OBSERVE_PERSISTED = 0x01
+LCB_OBSERVE_NOT_FOUND = 0x80
+LCB_OBSERVE_LOGICALLY_DELETED = 0x81
+
 # libcouchbase make_http_request types
 LCB_HTTP_TYPE_VIEW = 0
 LCB_HTTP_TYPE_MANAGEMENT = 1
@@ -57,27 +76,415 @@ class PycbKeyExists(PycbException):
     pass
 
 
+def _exception(error, errMsg):
+    if error == LCB_KEY_EEXISTS:
+        return PycbKeyExists(error, errMsg)
+    elif error == LCB_KEY_ENOENT:
+        return PycbKeyNotFound(error, errMsg)
+    else:
+        return PycbException(error, errMsg)
+
+
+# The _*_value functions turn a pylcb.Result into what the matching
+# Bucket method returns, or the exception it raises (returned, not raised)
+
+def _get_value(result):
+    if result.error == LCB_SUCCESS:
+        return result.flags, result.cas, result.value
+    errMsg = "error retrieving key, %s" % pylcb.strerror(result.error)
+    return _exception(result.error, errMsg)
+
+
+def _get_into_value(result):
+    if result.error == LCB_SUCCESS:
+        return result.flags, result.cas, result.value
+    errMsg = "error retrieving key, %s" % pylcb.strerror(result.error)
+    return _exception(result.error, errMsg)
+
+
+def _store_value(result):
+    # the new CAS of the item, which is never 0 for a stored item
+    if result.error == LCB_SUCCESS:
+        return result.cas
+    errMsg = "error storing key, %s" % pylcb.strerror(result.error)
+    return _exception(result.error, errMsg)
+
+
+def _remove_value(result):
+    if result.error == LCB_SUCCESS:
+        return True
+    errMsg = "error deleting key, %s" % pylcb.strerror(result.error)
+    return _exception(result.error, errMsg)
+
+
+def _touch_value(result):
+    if result.error == LCB_SUCCESS:
+        return result.cas
+    errMsg = "error touching key, %s" % pylcb.strerror(result.error)
+    return _exception(result.error, errMsg)
+
+
+def _unlock_value(result):
+    if result.error == LCB_SUCCESS:
+        return True
+    errMsg = "error unlocking key, %s" % pylcb.strerror(result.error)
+    return _exception(result.error, errMsg)
+
+
+def _durability(results, cas, persistTo, replicateTo):
+    """
+    True when the observe results of a key meet the durability, None when
+    they do not yet, or the exception to report when they never will.
+    """
+    persisted = 0
+    replicated = 0
+    for result in results:
+        # a server that did not answer counts as not there yet
+        if result.error != LCB_SUCCESS:
+            continue
+        if result.status in [LCB_OBSERVE_NOT_FOUND,
+                             LCB_OBSERVE_LOGICALLY_DELETED]:
+            if result.from_master:
+                return PycbKeyNotFound(LCB_KEY_ENOENT, "key not found")
+            continue
+        if cas and result.cas != cas:
+            # replicas may still hold an older version, but a different
+            # CAS on the master means the key was written again
+            if result.from_master:
+                return PycbKeyExists(LCB_KEY_EEXISTS,
+                                     "key was modified while observed")
+            continue
+
+        if result.status == LCB_OBSERVE_PERSISTED:
+            persisted += 1
+        if not result.from_master:
+            replicated += 1
+
+    if persisted >= persistTo and replicated >= replicateTo:
+        return True
+    return None
+
+
+def _arithmetic_value(result):
+    if result.error == LCB_SUCCESS:
+        return result.value
+    errMsg = "error incrementing/decrementing key, %s" % \
+             pylcb.strerror(result.error)
+    return PycbException(result.error, errMsg)
+
+
+def _view_path(view, params):
+    for param in params:
+        if param in ["key", "keys", "startkey", "endkey"]:
+            value = json.dumps(params[param])
+            params[param] = value
+
+    path = view
+    if len(params) > 0:
+        path += "?%s" % urllib.urlencode(params)
+    return path
+
+
+def _check_view(error, status, body):
+    # raise exception if http request failed
+    if error != LCB_SUCCESS:
+        errMsg = "get view, error:%s" % pylcb.strerror(error)
+        raise PycbException(error, errMsg)
+
+    # raise exception if http request was successful but status
+    # is not 200 or 201
+    if status not in [200, 201]:
+        errMsg = "get view, status:%s, response:%s" % (status, body)
+        raise PycbException(error, errMsg)
+
+
+def _cache_stats(stats):
+    lookups = stats['hits'] + stats['misses']
+    stats['hit_ratio'] = float(stats['hits']) / (lookups or 1)
+    stats['stale_rate'] = float(stats['stale']) / (stats['sampled'] or 1)
+    return stats
+
+
+class Transcoder(object):
+    """
+    Base for custom transcoders set with Connection.set_transcoder.
+
+    encode(value, flags) returns the bytes to store and the item flags,
+    with the format of the bytes in their top byte (FMT_MASK), and
+    decode(bytes, flags) turns them back into a value.  Both run in the
+    C callbacks for every value.  The defaults are the native transcoder,
+    so a subclass can handle its own types and pass the rest on:
+
+        bytes -> FMT_BYTES, unicode -> FMT_UTF8, int, long, bool, None,
+        dict, list, tuple and float -> FMT_JSON, anything else ->
+        FMT_PICKLE.  Items without a format are decoded as before, with
+        digit strings read as ints.
+    """
+
+    def encode(self, value, flags):
+        return pylcb.encode_value(value, flags)
+
+    def decode(self, bytes, flags):
+        return pylcb.decode_value(bytes, flags)
+
+
+class Future(object):
+    """
+    Result of an *_async operation on a connection that is not driven by a
+    running reactor.  Operations are only sent when the connection waits,
+    so any number of them can be in flight before the first result() call,
+    which waits once for all of them.
+    """
+
+    def __init__(self, connection):
+        self.connection = connection
+        self._done = False
+        self._result = None
+        self._exception = None
+        self._callbacks = []
+
+    def done(self):
+        return self._done
+
+    def set_result(self, result):
+        self._result = result
+        self._resolve()
+
+    def set_exception(self, exception):
+        self._exception = exception
+        self._resolve()
+
+    def _resolve(self):
+        self._done = True
+        callbacks = self._callbacks
+        self._callbacks = []
+        for callback in callbacks:
+            callback(self)
+
+    def add_done_callback(self, callback):
+        if self._done:
+            callback(self)
+        else:
+            self._callbacks.append(callback)
+
+    def exception(self):
+        if not self._done:
+            self.connection._wait()
+        if not self._done:
+            return PycbException(LCB_ERROR, "did not get callback")
+        return self._exception
+
+    def result(self):
+        exception = self.exception()
+        if exception is not None:
+            raise exception
+        return self._result
+
+
+class BucketFuture(Future):
+    """
+    Readiness of a bucket being created.  The bucket is ready once every
+    node reports it healthy through the management REST API and a bucket
+    connection got its configuration and can read a key.  result() polls
+    with exponential backoff until then and returns the connected bucket,
+    or raises once timeout seconds passed since the create.
+    """
+
+    def __init__(self, couchbase, cluster, name, timeout):
+        Future.__init__(self, cluster)
+        self.couchbase = couchbase
+        self.name = name
+        self.timeout = timeout
+        self.expireTime = time.time() + timeout
+        self.interval = 0.05
+
+    def poll(self):
+        """
+        Check readiness once without waiting and return done().
+        """
+        if self._done:
+            return True
+
+        try:
+            if self.connection.bucket_ready(self.name):
+                bucket = self.couchbase.bucket(self.name)
+                # "To ensure a bucket is available the recommended
+                #  approach is try to read a key from the bucket."
+                try:
+                    bucket.get("pycb:ready")
+                except PycbKeyNotFound:
+                    pass
+                self.set_result(bucket)
+                return True
+        except (PycbException, IOError) as e:
+            # pylcb raises IOError when the instance can not be created or
+            # connected yet
+            lastError = e
+        else:
+            lastError = None
+
+        if time.time() > self.expireTime:
+            errMsg = "newly created bucket did not become " \
+                     "available within %s seconds" % self.timeout
+            if lastError is not None:
+                errMsg += ", %s" % lastError
+            self.set_exception(PycbException(LCB_ERROR, errMsg))
+        return self._done
+
+    def exception(self):
+        while not self.poll():
+            time.sleep(self.interval)
+            self.interval = min(self.interval * 2, 2.0)
+        return self._exception
+
+
 class Couchbase(object):
-    def __init__(self, host, username, password):
+    def __init__(self, host, username, password, poolMinSize=0,
+                 poolMaxSize=None, poolIdleTimeout=300, compressThreshold=0,
+                 nearCacheSize=0, nearCacheTTL=1.0, missCacheSize=0,
+                 missCacheTTL=0.5, singleFlight=False, batchWindow=0,
+                 batchSize=64):
         self.host = host
         self.username = username
         self.password = password
-
-    def bucket(self, bucketName, timeout=None):
+        # bucket() is pooled when poolMaxSize is set
+        self.poolMinSize = poolMinSize
+        self.poolMaxSize = poolMaxSize
+        self.poolIdleTimeout = poolIdleTimeout
+        # values of at least compressThreshold bytes are stored compressed
+        self.compressThreshold = compressThreshold
+        # gets are served from a near cache of nearCacheSize keys for up
+        # to nearCacheTTL seconds
+        self.nearCacheSize = nearCacheSize
+        self.nearCacheTTL = nearCacheTTL
+        # and fail for up to missCacheTTL seconds for missCacheSize keys
+        # recently found missing
+        self.missCacheSize = missCacheSize
+        self.missCacheTTL = missCacheTTL
+        # concurrent gets of a key and identical view requests through
+        # the buckets of this object share one round trip
+        self.singleFlight = singleFlight
+        self.flightGroups = {}
+        self.flightGroupsLock = threading.Lock()
+        # single gets and stores without cas issued concurrently on the
+        # connections of this object to one bucket within batchWindow
+        # seconds are sent together, up to batchSize of them
+        self.batchWindow = batchWindow
+        self.batchSize = batchSize
+        self.batchers = {}
+        self.batchersLock = threading.Lock()
+        # write_behind hands out one open writer per bucket
+        self.writers = {}
+        self.writersLock = threading.Lock()
+
+    def bucket(self, bucketName, timeout=None, reactor=None):
+        if self.poolMaxSize is None or reactor is not None:
+            return self._new_bucket(bucketName, timeout, reactor)
+        return self.pool(bucketName, timeout).thread_connection()
+
+    def _new_bucket(self, bucketName, timeout, reactor=None, plain=False):
         bucket = Bucket(self.host, self.username, self.password,
-                        bucketName, timeout)
+                        bucketName, timeout, reactor)
         # bucket.connect()
+        if self.compressThreshold:
+            bucket.set_compression(self.compressThreshold)
+        # a plain connection only encodes like the others, for batches
+        if plain:
+            return bucket
+        if self.nearCacheSize:
+            bucket.set_near_cache(self.nearCacheSize, self.nearCacheTTL)
+        if self.missCacheSize:
+            bucket.set_miss_cache(self.missCacheSize, self.missCacheTTL)
+        if self.singleFlight:
+            bucket.singleFlight = self._flight_group(bucketName)
+        # a thread blocked in a batch would stall a host event loop
+        if self.batchWindow and reactor is None:
+            bucket.batcher = self._batcher(bucketName, timeout)
         return bucket
 
-    def create(self, name, saslPassword='',
-               ramQuotaMB=100, replicaNumber=0, **params):
-
-        # special case for memcached
-        memcache = False
-        if 'bucketType' in params:
-            if params['bucketType'] == "memcached":
-                memcache = True
+    def _batcher(self, bucketName, timeout):
+        from .batching import AutoBatcher
+
+        def factory():
+            return self._new_bucket(bucketName, timeout, plain=True)
+
+        # connections made with different timeouts are not interchangeable
+        key = (self.host, self.username, self.password, bucketName, timeout)
+        with self.batchersLock:
+            batcher = self.batchers.get(key)
+            if batcher is None:
+                batcher = AutoBatcher(factory, window=self.batchWindow,
+                                      maxBatch=self.batchSize)
+                self.batchers[key] = batcher
+            return batcher
+
+    def _flight_group(self, bucketName):
+        # only connections made alike with the same credentials share
+        # results, so the group is this object's, never the process's
+        from .singleflight import SingleFlight
+
+        key = (self.host, self.username, self.password, bucketName)
+        with self.flightGroupsLock:
+            group = self.flightGroups.get(key)
+            if group is None:
+                group = SingleFlight()
+                self.flightGroups[key] = group
+            return group
+
+    def write_behind(self, bucketName, interval=1.0, timeout=None):
+        """
+        Return the WriteBehind of bucketName of this object, which sums
+        incr/decr deltas and keeps the last set of each key, and writes
+        them every interval seconds on a connection of its own.  While it
+        is open the same writer is returned, so interval and timeout must
+        match the ones it was made with.
+        """
+        from .writebehind import WriteBehind
+
+        def factory():
+            return self._new_bucket(bucketName, timeout)
+
+        # like _flight_group, deltas are only summed across connections
+        # made alike with the same credentials
+        key = (self.host, self.username, self.password, bucketName)
+        with self.writersLock:
+            writer, writerTimeout = self.writers.get(key, (None, None))
+            if writer is None or writer.closed:
+                writer = WriteBehind(factory, interval=interval)
+                self.writers[key] = (writer, timeout)
+            elif writer.interval != interval or writerTimeout != timeout:
+                raise ValueError("the write-behind buffer of %s is open "
+                                 "with interval %s and timeout %s"
+                                 % (bucketName, writer.interval,
+                                    writerTimeout))
+            return writer
+
+    def checkout(self, bucketName, timeout=None):
+        return self.pool(bucketName, timeout).connection()
+
+    def pool(self, bucketName, timeout=None):
+        from .pool import get_pool
+
+        def factory():
+            return self._new_bucket(bucketName, timeout)
+
+        # connections made with different timeouts are not interchangeable
+        key = (self.host, self.username, self.password, bucketName, timeout)
+        return get_pool(key, factory, minSize=self.poolMinSize,
+                        maxSize=self.poolMaxSize or 10,
+                        idleTimeout=self.poolIdleTimeout)
 
+    def create(self, name, saslPassword='',
+               ramQuotaMB=100, replicaNumber=0, timeout=60, **params):
+        return self.create_async(name, saslPassword, ramQuotaMB,
+                                 replicaNumber, timeout, **params).result()
+
+    def create_async(self, name, saslPassword='',
+                     ramQuotaMB=100, replicaNumber=0, timeout=60, **params):
+        """
+        Create a bucket and return a BucketFuture for its readiness
+        without waiting, so several buckets can be provisioned at once.
+        """
         payload = dict(
             saslPassword=saslPassword,
             ramQuotaMB=ramQuotaMB,
@@ -90,36 +497,7 @@ class Couchbase(object):
                           None, None)
         # cluster.connect()
         cluster.create_bucket(name, **payload)
-
-        # Bucket was successfully created.  Now wait until it is available.
-        # According to Couchbase documentation:
-        #
-        #   "To ensure a bucket is available the recommended approach
-        #    is try to read a key from the bucket. If you receive a
-        #    'key not found' error, or the document for the key, the
-        #    bucket exists and is available to all nodes in a cluster."
-        #
-        # We wait a maximum of 60 seconds for that level of goodness
-        # to exist.
-
-        bucket = self.bucket(name)
-        stopTime = time.time() + 60
-        while True:
-            if memcache is True:
-                time.sleep(10)
-
-            try:
-                bucket.get("whatever")
-            except PycbException as e:
-                if e.error == LCB_KEY_ENOENT:
-                    break
-
-            if time.time() > stopTime:
-                errMsg = "newly created bucket did not become " \
-                         "available within 60 seconds"
-                raise PycbException(LCB_ERROR, errMsg)
-
-        return bucket
+        return BucketFuture(self, cluster, name, timeout)
 
     def delete(self, name):
         cluster = Cluster(self.host, self.username, self.password,
@@ -129,52 +507,93 @@ class Couchbase(object):
 
 
 class Connection(object):
-    def __init__(self, host, username, password, bucketName, timeout):
+    def __init__(self, host, username, password, bucketName, timeout,
+                 reactor=None):
         self.timeout = timeout
+        self.singleFlight = None    # a SingleFlight coalescing reads
+        self.batcher = None         # an AutoBatcher batching operations
+        self.nearCacheSize = 0      # capacities of the caches in C
+        self.missCacheSize = 0
         if bucketName is None:
             connectionType = LCB_TYPE_CLUSTER
             bucketName = ""
         else:
             connectionType = LCB_TYPE_BUCKET
-        self.evbase = pylcb.create_event_base()
-        self.instance = pylcb.create(self.evbase, host, username, password,
+
+        # with a reactor (see pycb.reactor) the instance is driven by the
+        # host event loop or runs on a libevent base shared with other
+        # instances, otherwise by a private libevent base
+        self.reactor = reactor
+        if reactor is None:
+            self.evbase = pylcb.create_event_base()
+        else:
+            self.evbase = getattr(reactor, 'evbase', None)
+        # the connect timeout is a libevent timer, which a host loop has not
+        if self.timeout and self.evbase is None:
+            raise ValueError("a connect timeout can not be used with a "
+                             "host event loop reactor")
+        if self.evbase is not None:
+            io = self.evbase
+        else:
+            io = pylcb.create_io_ops(reactor)
+        self.instance = pylcb.create(io, host, username, password,
                                      bucketName, connectionType)
 
-        pylcb.set_arithmetic_callback(self.instance, self.arithmetic_callback)
+        # responses are collected in C into the cookie each operation is
+        # scheduled with; python callbacks are only needed for connecting
         pylcb.set_configuration_callback(self.instance,
                                          self.configuration_callback)
         pylcb.set_error_callback(self.instance, self.error_callback)
-        pylcb.set_flush_callback(self.instance, self.flush_callback)
-        pylcb.set_get_callback(self.instance, self.get_callback)
-        pylcb.set_http_complete_callback(self.instance,
-                                         self.http_complete_callback)
-        pylcb.set_remove_callback(self.instance, self.remove_callback)
-        pylcb.set_stat_callback(self.instance, self.stat_callback)
-        pylcb.set_store_callback(self.instance, self.store_callback)
 
         self.connecting = True
         self.errorResults = []
+        self.connectCallbacks = []
         pylcb.connect(self.instance)
 
-        if self.timeout:
-            self.expireTime = time.time() + self.timeout
-            while self.connecting:
-                pylcb.run_event_loop_nonblock(self.evbase)
-                if time.time() > self.expireTime:
-                    raise PycbException(LCB_ETIMEDOUT,
-                                        "connect attempt timed out")
+        # a running host loop must not be blocked, it completes the
+        # connect by itself; see on_connect
+        if reactor is not None and reactor.running():
+            return
+
+        if self.timeout and self.evbase is not None:
+            if not pylcb.wait_connect(self.instance, self.timeout):
+                raise PycbException(LCB_ETIMEDOUT,
+                                    "connect attempt timed out")
         else:
             pylcb.wait(self.instance)
 
+        error = self._connect_error()
+        if error is not None:
+            raise error
+
+    def _connect_error(self):
         if len(self.errorResults) == 0:
-            return
+            return None
 
         # special case error 22
         lastResult = self.errorResults[len(self.errorResults) - 1]
         if lastResult['error'] in [LCB_SUCCESS, 22]:
-            return
+            return None
+
+        return PycbException(lastResult['error'], lastResult['errinfo'])
+
+    def on_connect(self, callback):
+        """
+        Call callback(error) once the connection is established, with error
+        None on success or the PycbException connecting failed with.  Used
+        with a reactor whose loop was already running at creation.
+        """
+        if self.connecting:
+            self.connectCallbacks.append(callback)
+        else:
+            callback(self._connect_error())
 
-        raise PycbException(lastResult['error'], lastResult['errinfo'])
+    def _connected(self):
+        self.connecting = False
+        callbacks = self.connectCallbacks
+        self.connectCallbacks = []
+        for callback in callbacks:
+            callback(self._connect_error())
 
     def get_timeout(self):
         return pylcb.get_timeout(self.instance)
@@ -182,39 +601,166 @@ class Connection(object):
     def set_timeout(self, timeout):
         pylcb.set_timeout(self.instance, timeout)
 
-    def arithmetic_callback(self, cookie, error, key, value):
-        self.arithmeticResult = dict(error=error, key=key, value=value)
+    def set_transcoder(self, transcoder):
+        """
+        Encode and decode values with transcoder, a Transcoder, instead
+        of the native transcoder; None restores the native one.
+        """
+        pylcb.set_transcoder(self.instance, transcoder)
+        # batches are encoded by a connection without it
+        self.batcher = None
+
+    def set_compression(self, threshold, level=1):
+        """
+        Store values of at least threshold bytes zlib compressed at level
+        (-1 to 9) when that makes them smaller, marked with the FMT_ZLIB
+        flag bit.  Compressed values are inflated on get.  0 turns it off.
+
+        While it is on, append and prepend raise ValueError: the server
+        joins the raw bytes, and a value stored compressed could no
+        longer be inflated.
+        """
+        pylcb.set_compression(self.instance, threshold, level)
+        self.batcher = None
+
+    def compression_stats(self):
+        """
+        Counters of values compressed, skipped because they did not get
+        smaller, and decompressed, the bytes before and after compression
+        and their ratio.
+        """
+        stats = pylcb.compression_stats(self.instance)
+        stats['ratio'] = float(stats['bytes_in']) / (stats['bytes_out'] or 1)
+        return stats
+
+    def set_near_cache(self, capacity, ttl=1.0, sampleEvery=0):
+        """
+        Keep up to capacity recently read keys in process and answer get
+        and get_multi from them for up to ttl seconds, without a round
+        trip.  Writes made through this connection drop the key, writes
+        by other clients are seen once the entry expires.  Resizing
+        empties the cache, 0 turns it off.
+
+        With sampleEvery set, every sampleEvery-th hit is read from the
+        server anyway to measure how many hits are stale.
+        """
+        pylcb.set_near_cache(self.instance, capacity, ttl, sampleEvery)
+        self.nearCacheSize = capacity
+
+    def near_cache_stats(self):
+        """
+        Counters of near cache hits, misses, evictions, expirations,
+        invalidations, sampled and stale hits, its size and capacity, the
+        hit ratio and the stale rate of the sampled hits.
+        """
+        return _cache_stats(pylcb.near_cache_stats(self.instance))
+
+    def set_miss_cache(self, capacity, ttl=0.5, sampleEvery=100):
+        """
+        Remember up to capacity keys get found missing, and fail repeated
+        gets of them with PycbKeyNotFound for up to ttl seconds without a
+        round trip.  Stores made through this connection forget the key,
+        keys created by other clients are seen once the entry expires.
+
+        Every sampleEvery-th hit is still sent to the server, and
+        miss_cache_stats() reports how often the key existed after all.
+        """
+        pylcb.set_miss_cache(self.instance, capacity, ttl, sampleEvery)
+        self.missCacheSize = capacity
+
+    def miss_cache_stats(self):
+        """
+        Like near_cache_stats(), the stale rate being the rate of false
+        positives.
+        """
+        return _cache_stats(pylcb.miss_cache_stats(self.instance))
+
+    def set_callback(self, operation, callback):
+        """
+        Opt in to a python callback for every response to operation
+        ("arithmetic", "flush", "get", "http_complete", "remove", "stat" or
+        "store").  It is called with the raw response arguments, in
+        addition to the native result collection the Bucket methods use.
+        """
+        setter = getattr(pylcb, "set_%s_callback" % operation)
+        setter(self.instance, callback)
 
     def configuration_callback(self, config):
-        self.connecting = False
+        self._connected()
 
     def error_callback(self, error, errinfo):
         self.errorResults.append(dict(error=error, errinfo=errinfo))
-        self.connecting = False
+        self._connected()
 
-    def flush_callback(self, cookie, error, server):
-        if server is not None:
-            self.flushResults.append(dict(error=error, server=server))
-
-    def get_callback(self, cookie, error, key, bytes, flags):
-        self.getResult = dict(error=error, key=key,
-                              bytes=bytes, flags=flags)
-
-    def http_complete_callback(self, cookie, error,
-                               status, path, headers, bytes):
-        self.httpResult = dict(error=error, status=status, path=path,
-                               headers=headers, bytes=bytes)
+    def _wait(self):
+        # a running host loop can not be entered again to block on it
+        if self.reactor is not None and self.reactor.running():
+            errMsg = "synchronous call while the reactor is running, " \
+                     "use the _async methods"
+            raise PycbException(LCB_ERROR, errMsg)
+        pylcb.wait(self.instance)
 
-    def remove_callback(self, cookie, error, key):
-        self.removeResult = dict(error=error, key=key)
+    def _wait_one(self, results, interpret, callbackName):
+        """
+        Wait for the single result of an operation scheduled with results
+        as cookie, and return what interpret makes of it, raising if that
+        is an exception.
+        """
+        # near cache hits are delivered before any wait
+        if not results:
+            self._wait()
+        if not results:
+            errMsg = "did not get %s" % callbackName
+            raise PycbException(LCB_ERROR, errMsg)
 
-    def stat_callback(self, cookie, error, server, name, stat):
-        if server is not None:
-            self.statsResults.append(dict(error=error, server=server,
-                                          name=name, stat=stat))
+        value = interpret(results[0])
+        if isinstance(value, PycbException):
+            raise value
+        return value
+
+    def _future(self):
+        if self.reactor is not None and self.reactor.running():
+            return self.reactor.create_future()
+        return Future(self)
+
+    def _async(self, interpret, schedule, *args):
+        """
+        Schedule an operation with its own callable cookie and return a
+        future resolved from the C callback with what interpret makes of
+        the result.  On a connection still connecting in the background
+        the operation is scheduled once the connect completes.
+        """
+        future = self._future()
+
+        def resolve(result):
+            value = interpret(result)
+            if isinstance(value, PycbException):
+                future.set_exception(value)
+            else:
+                future.set_result(value)
+
+        def submit(error):
+            if error is not None:
+                future.set_exception(error)
+                return
+            try:
+                schedule(self.instance, resolve, *args)
+            except IOError as e:
+                future.set_exception(PycbException(LCB_ERROR, str(e)))
+
+        self.on_connect(submit)
+        return future
+
+    def _http_request(self, type, path, body, method, contentType):
+        results = []
+        pylcb.make_http_request(self.instance, results, type, path, body,
+                                method, 0, contentType)
+        self._wait()
+        if not results:
+            errMsg = "did not get http_complete_callback"
+            raise PycbException(LCB_ERROR, errMsg)
 
-    def store_callback(self, cookie, error, key):
-        self.storeResult = dict(error=error, key=key)
+        return results[0]
 
 
 class Cluster(Connection):
@@ -222,218 +768,643 @@ class Cluster(Connection):
         payload.update(dict(name=name))
         body = urllib.urlencode(payload)
 
-        pylcb.make_http_request(
-            self.instance,
-            None,
+        result = self._http_request(
             LCB_HTTP_TYPE_MANAGEMENT,
             "pools/default/buckets",
             body,
             LCB_HTTP_METHOD_POST,
-            0,
             "application/x-www-form-urlencoded"
         )
-        pylcb.wait(self.instance)
 
         # raise exception if http request failed
-        if self.httpResult['error'] != LCB_SUCCESS:
-            errMsg = "create bucket, error:%s" % \
-                     pylcb.pylcb_strerror(self.httpResult['error'])
-            raise PycbException(self.httpResult['error'], errMsg)
+        if result.error != LCB_SUCCESS:
+            errMsg = "create bucket, error:%s" % pylcb.strerror(result.error)
+            raise PycbException(result.error, errMsg)
 
         # raise exception if http request was successful but status
         # is not 202 (Accepted)
-        if self.httpResult['status'] != 202:
+        if result.status != 202:
             errMsg = "create bucket, status:%s, response:%s" % \
-                     (self.httpResult['status'], self.httpResult['bytes'])
-            raise PycbException(self.httpResult['error'], errMsg)
+                     (result.status, result.value)
+            raise PycbException(result.error, errMsg)
+
+    def bucket_ready(self, name):
+        """
+        True when the bucket exists and every node reports it healthy.
+        """
+        result = self._http_request(
+            LCB_HTTP_TYPE_MANAGEMENT,
+            "pools/default/buckets/%s" % name,
+            "",
+            LCB_HTTP_METHOD_GET,
+            "application/x-www-form-urlencoded"
+        )
+
+        # raise exception if http request failed
+        if result.error != LCB_SUCCESS:
+            errMsg = "bucket status, error:%s" % pylcb.strerror(result.error)
+            raise PycbException(result.error, errMsg)
+
+        # the bucket is not known to the cluster manager yet
+        if result.status == 404:
+            return False
+
+        if result.status != 200:
+            errMsg = "bucket status, status:%s, response:%s" % \
+                     (result.status, result.value)
+            raise PycbException(result.error, errMsg)
+
+        nodes = json.loads(result.value).get('nodes', [])
+        return len(nodes) > 0 and \
+            all(node.get('status') == 'healthy' for node in nodes)
 
     def delete_bucket(self, name):
-        pylcb.make_http_request(
-            self.instance,
-            None,
+        result = self._http_request(
             LCB_HTTP_TYPE_MANAGEMENT,
             "pools/default/buckets/%s" % name,
             "",
             LCB_HTTP_METHOD_DELETE,
-            0,
             "application/x-www-form-urlencoded"
         )
-        pylcb.wait(self.instance)
 
         # raise exception if http request failed
-        if self.httpResult['error'] != LCB_SUCCESS:
-            errMsg = "delete bucket, error:%s" % \
-                     pylcb.pylcb_strerror(self.httpResult['error'])
-            raise PycbException(self.httpResult['error'], errMsg)
+        if result.error != LCB_SUCCESS:
+            errMsg = "delete bucket, error:%s" % pylcb.strerror(result.error)
+            raise PycbException(result.error, errMsg)
 
         # raise exception if http request was successful but status
         # is not 200 (OK)
-        if self.httpResult['status'] != 200:
+        if result.status != 200:
             errMsg = "delete bucket, status:%s, response:%s" % \
-                     (self.httpResult['status'], self.httpResult['bytes'])
-            raise PycbException(self.httpResult['error'], errMsg)
+                     (result.status, result.value)
+            raise PycbException(result.error, errMsg)
 
 
 class Bucket(Connection):
     def add(self, key, exp, flags, val):
         return self._store(key, exp, flags, val, LCB_ADD)
 
-    def replace(self, key, exp, flags, val):
-        return self._store(key, exp, flags, val, LCB_REPLACE)
+    def replace(self, key, exp, flags, val, cas=0):
+        return self._store(key, exp, flags, val, LCB_REPLACE, cas)
+
+    def set(self, key, expiration, flags, value, cas=0):
+        return self._store(key, expiration, flags, value, LCB_SET, cas)
+
+    def append(self, key, value, cas=0):
+        return self._store(key, 0, 0, value, LCB_APPEND, cas)
+
+    def prepend(self, key, value, cas=0):
+        return self._store(key, 0, 0, value, LCB_PREPEND, cas)
+
+    def _store(self, key, expiration, flags, value, operation, cas=0):
+        if self.batcher is not None and not cas:
+            return self.batcher.store(self, key, expiration, flags, value,
+                                      operation)
+        results = []
+        pylcb.store(self.instance, results, key,
+                    expiration, flags, value, operation, cas)
+        return self._wait_one(results, _store_value, "store_callback")
+
+    def add_multi(self, items, expiration=0, flags=0):
+        return self._store_multi(items, expiration, flags, LCB_ADD)
+
+    def replace_multi(self, items, expiration=0, flags=0):
+        return self._store_multi(items, expiration, flags, LCB_REPLACE)
+
+    def set_multi(self, items, expiration=0, flags=0):
+        return self._store_multi(items, expiration, flags, LCB_SET)
+
+    def append_multi(self, items):
+        return self._store_multi(items, 0, 0, LCB_APPEND)
+
+    def prepend_multi(self, items):
+        return self._store_multi(items, 0, 0, LCB_PREPEND)
+
+    def _store_multi(self, items, expiration, flags, operation):
+        """
+        Store many keys with a single lcb_store and a single wait.
+
+        items maps key -> value, or key -> (expiration, flags, value) to
+        override the shared expiration and flags for that key, so a tuple
+        value must be given in the latter form.  Returns a
+        tuple (stored, errors): stored maps each stored key to its new
+        CAS, errors maps every other key to the exception _store() would
+        have raised.
+        """
+        commands = []
+        for key, value in items.iteritems():
+            if isinstance(value, tuple):
+                commands.append((key,) + value)
+            else:
+                commands.append((key, expiration, flags, value))
+
+        results = {}
+        pylcb.store_multi(self.instance, results, commands, operation)
+        self._wait()
+
+        stored = {}
+        errors = {}
+        for key in items:
+            result = results.get(key)
+            if result is None:
+                errors[key] = PycbException(LCB_ERROR,
+                                            "did not get store_callback")
+                continue
+
+            value = _store_value(result)
+            if isinstance(value, PycbException):
+                errors[key] = value
+            else:
+                stored[key] = value
+
+        return stored, errors
+
+    def get(self, key, expiration=0):
+        """
+        Returns (flags, cas, value).  A non zero expiration also sets a
+        new expiration on the item in the same round trip.
+        """
+        if self.singleFlight is not None and not expiration:
+            return self.singleFlight.do(("get", key), self._get, key)
+        return self._get(key, expiration)
+
+    def _get(self, key, expiration=0):
+        # the batch connection has none of the caches of this one
+        if self.batcher is not None and not expiration and \
+                not self.nearCacheSize and not self.missCacheSize:
+            return self.batcher.get(key)
+        results = []
+        pylcb.get(self.instance, results, key, expiration)
+        return self._wait_one(results, _get_value, "get_callback")
+
+    def get_locked(self, key, lockTime=15):
+        """
+        Get key and lock it for lockTime seconds.  Until it is unlocked,
+        stored with the returned cas, or the lock expires, other writers
+        fail.  Returns (flags, cas, value).
+        """
+        results = []
+        pylcb.get(self.instance, results, key, lockTime, 1)
+        return self._wait_one(results, _get_value, "get_callback")
+
+    def unlock(self, key, cas):
+        results = []
+        pylcb.unlock(self.instance, results, key, cas)
+        return self._wait_one(results, _unlock_value, "unlock_callback")
+
+    def touch(self, key, expiration):
+        results = []
+        pylcb.touch(self.instance, results, [key], expiration)
+        return self._wait_one(results, _touch_value, "touch_callback")
+
+    def touch_multi(self, keys, expiration):
+        """
+        Set a new expiration on many keys with a single lcb_touch and a
+        single wait.  Returns a tuple (touched, errors): touched maps each
+        touched key to its CAS, errors maps every other key to the
+        exception touch() would have raised.
+        """
+        keys = list(set(keys))
+        results = {}
+        pylcb.touch(self.instance, results, keys, expiration)
+        self._wait()
+
+        touched = {}
+        errors = {}
+        for key in keys:
+            result = results.get(key)
+            if result is None:
+                errors[key] = PycbException(LCB_ERROR,
+                                            "did not get touch_callback")
+                continue
+
+            value = _touch_value(result)
+            if isinstance(value, PycbException):
+                errors[key] = value
+            else:
+                touched[key] = value
+
+        return touched, errors
+
+    def get_into(self, key, buffer):
+        """
+        Like get(), but the value is copied into the start of buffer, a
+        bytearray that is grown as needed and can be reused across calls,
+        and (flags, cas, nbytes) is returned; the value is buffer[:nbytes].
+        No new string is allocated for the value, and no integer
+        conversion is attempted.  A memoryview of buffer held by the
+        caller stops it from growing, and a larger value then fails.
+        """
+        results = []
+        pylcb.get(self.instance, (results, buffer), key)
+        return self._wait_one(results, _get_into_value, "get_callback")
+
+    def get_multi(self, keys):
+        """
+        Fetch many keys with a single lcb_get and a single wait.
+
+        Returns a tuple (values, errors).  values maps each found key to
+        (flags, cas, value), errors maps every other key to the exception
+        get() would have raised for it.
+        """
+        keys = list(set(keys))
+        results = {}
+        pylcb.get_multi(self.instance, results, keys)
+        self._wait()
+
+        values = {}
+        errors = {}
+        for key in keys:
+            result = results.get(key)
+            if result is None:
+                errors[key] = PycbException(LCB_ERROR,
+                                            "did not get get_callback")
+                continue
+
+            value = _get_value(result)
+            if isinstance(value, PycbException):
+                errors[key] = value
+            else:
+                values[key] = value
+
+        return values, errors
+
+    def pipeline(self):
+        return Pipeline(self)
+
+    # The *_async methods return a future instead of waiting, so one
+    # connection can have many operations in flight.  It is the reactor's
+    # future when the connection runs on a running reactor, otherwise a
+    # pycb Future whose result() waits on the connection.
+
+    def add_async(self, key, exp, flags, val):
+        return self._store_async(key, exp, flags, val, LCB_ADD)
+
+    def replace_async(self, key, exp, flags, val, cas=0):
+        return self._store_async(key, exp, flags, val, LCB_REPLACE, cas)
+
+    def set_async(self, key, expiration, flags, value, cas=0):
+        return self._store_async(key, expiration, flags, value, LCB_SET, cas)
+
+    def append_async(self, key, value, cas=0):
+        return self._store_async(key, 0, 0, value, LCB_APPEND, cas)
+
+    def prepend_async(self, key, value, cas=0):
+        return self._store_async(key, 0, 0, value, LCB_PREPEND, cas)
+
+    def _store_async(self, key, expiration, flags, value, operation, cas=0):
+        return self._async(_store_value, pylcb.store,
+                           key, expiration, flags, value, operation, cas)
+
+    def get_async(self, key):
+        return self._async(_get_value, pylcb.get, key)
+
+    def delete_async(self, key, cas=0):
+        return self._async(_remove_value, pylcb.remove, key, cas)
+
+    def incr_async(self, key, amt=1, init=0, exp=0):
+        return self._async(_arithmetic_value, pylcb.arithmetic,
+                           key, amt, init, exp)
+
+    def decr_async(self, key, amt=1, init=0, exp=0):
+        return self._async(_arithmetic_value, pylcb.arithmetic,
+                           key, -amt, init, exp)
 
-    def set(self, key, expiration, flags, value):
-        return self._store(key, expiration, flags, value, LCB_SET)
+    def delete(self, key, cas=0):
+        results = []
+        pylcb.remove(self.instance, results, key, cas)
+        return self._wait_one(results, _remove_value, "remove_callback")
+
+    def update(self, key, fn, retries=10, expiration=0):
+        """
+        Replace the value of key with fn(value) without an external lock.
+        The new value is stored with the CAS it was read with, and when
+        another writer got in between, the value is read again and fn
+        retried, up to retries times.  Returns the stored value.
+        """
+        if retries < 0:
+            raise ValueError("retries must not be negative")
+        for attempt in range(retries + 1):
+            flags, cas, value = self.get(key)
+            newValue = fn(value)
+            try:
+                self.set(key, expiration, flags, newValue, cas)
+                return newValue
+            except PycbKeyExists as e:
+                conflict = e
 
-    def append(self, key, value):
-        return self._store(key, 0, 0, value, LCB_APPEND)
+        raise conflict
 
-    def prepend(self, key, value):
-        return self._store(key, 0, 0, value, LCB_PREPEND)
+    def incr(self, key, amt=1, init=0, exp=0):
+        return self._arithmetic(key, amt, init, exp)
 
-    def _store(self, key, expiration, flags, value, operation):
-        self.storeResult = None
-        pylcb.store(self.instance, self, key,
-                    expiration, flags, value, operation)
-        pylcb.wait(self.instance)
+    def decr(self, key, amt=1, init=0, exp=0):
+        return self._arithmetic(key, -amt, init, exp)
 
-        result = self.storeResult
-        if result is None:
-            errMsg = "did not get store_callback"
-            raise PycbException(LCB_ERROR, errMsg)
+    def _arithmetic(self, key, delta, initial, expiration):
+        results = []
+        pylcb.arithmetic(self.instance, results, key,
+                         delta, initial, expiration)
+        return self._wait_one(results, _arithmetic_value,
+                              "arithmetic_callback")
+
+    def observe(self, key):
+        """
+        Returns the pylcb.ObserveResult of every server that holds key,
+        one of them from the master.
+        """
+        results = []
+        pylcb.observe(self.instance, results, [key])
+        self._wait()
+        return results
+
+    def endure_multi(self, keys, persistTo=1, replicateTo=0, timeout=10,
+                     interval=0.01, maxInterval=0.5):
+        """
+        Wait until every key is persisted on persistTo servers and held
+        in memory by replicateTo replicas.  keys may be a list, or a
+        mapping of key to the CAS a store returned, such as the stored
+        dict of set_multi, so a later write is not taken for this one.
+
+        All pending keys are observed with a single lcb_observe per
+        round, and the delay between rounds doubles from interval up to
+        maxInterval.  Returns a tuple (endured, errors): endured lists the
+        keys that reached the durability, errors maps every other key to
+        an exception.
+        """
+        if hasattr(keys, 'items'):
+            casValues = dict(keys)
+        else:
+            casValues = dict.fromkeys(keys, 0)
+
+        pending = set(casValues)
+        endured = []
+        errors = {}
+        expireTime = time.time() + timeout
+        while pending:
+            results = []
+            pylcb.observe(self.instance, results, list(pending))
+            self._wait()
+
+            states = dict((key, []) for key in pending)
+            for result in results:
+                if result.key in states:
+                    states[result.key].append(result)
+
+            for key, keyResults in states.items():
+                state = _durability(keyResults, casValues[key],
+                                    persistTo, replicateTo)
+                if state is True:
+                    endured.append(key)
+                    pending.discard(key)
+                elif state is not None:
+                    errors[key] = state
+                    pending.discard(key)
+
+            if not pending:
+                break
+            if time.time() + interval > expireTime:
+                errMsg = "durability not reached within %s seconds" % timeout
+                for key in pending:
+                    errors[key] = PycbException(LCB_ETIMEDOUT, errMsg)
+                break
+            time.sleep(interval)
+            interval = min(interval * 2, maxInterval)
+
+        return endured, errors
 
-        error = result['error']
-        if error == LCB_SUCCESS:
-            return True
+    def stats(self, name=""):
+        results = []
+        pylcb.stats(self.instance, results, name)
+        self._wait()
 
-        errMsg = "error storing key, %s" % pylcb.strerror(result['error'])
-        if error == LCB_KEY_EEXISTS:
-            raise PycbKeyExists(error, errMsg)
-        elif error == LCB_KEY_ENOENT:
-            raise PycbKeyNotFound(error, errMsg)
-        else:
-            raise PycbException(result['error'], errMsg)
+        return [dict(error=result.error, server=result.server,
+                     name=result.key, stat=result.value)
+                for result in results]
 
-    def get(self, key):
-        self.getResult = None
-        pylcb.get(self.instance, self, key)
-        pylcb.wait(self.instance)
+    def flush(self):
+        results = []
+        pylcb.flush(self.instance, results)
+        self._wait()
 
-        result = self.getResult
-        if result is None:
-            errMsg = "did not get get_callback"
-            raise PycbException(LCB_ERROR, errMsg)
+        return [dict(error=result.error, server=result.server)
+                for result in results]
 
-        error = result['error']
-        if error == LCB_SUCCESS:
-            # for compatibility with old couchbase python client,
-            # do an integer conversion to strings made up only of numeric
-            # digits
-            bytes = result['bytes']
-            if bytes.isdigit():
-                bytes = int(bytes)
+    def view(self, view, **params):
+        path = _view_path(view, params)
+        if self.singleFlight is not None:
+            return self.singleFlight.do(("view", path), self._view, path)
+        return self._view(path)
 
-            return result['flags'], 0, bytes
+    def _view(self, path):
+        result = self._http_request(
+            LCB_HTTP_TYPE_VIEW,
+            path,
+            "",
+            LCB_HTTP_METHOD_GET,
+            "application/json"
+        )
+        _check_view(result.error, result.status, result.value)
 
-        errMsg = "error retrieving key, %s" % pylcb.strerror(result['error'])
-        if error == LCB_KEY_ENOENT:
-            raise PycbKeyNotFound(error, errMsg)
-        else:
-            raise PycbException(result['error'], errMsg)
+        response = json.loads(result.value)
+        if 'rows' in response:
+            return response['rows']
 
-    def delete(self, key, cas=0):
-        self.removeResult = None
-        pylcb.remove(self.instance, self, key)
-        pylcb.wait(self.instance)
+    def view_stream(self, view, **params):
+        """
+        Generator over the rows of a view, parsed in C from a chunked
+        response as it arrives.  Every turn of the libevent loop hands out
+        the rows that arrived in it, so memory does not grow with the size
+        of the result.
+
+        Needs a connection driven by libevent, its own or a
+        SharedEventBase.  A host event loop can not be turned from here,
+        so on the other reactors it raises PycbException; use view().
+        """
+        if self.evbase is None:
+            errMsg = "view_stream needs a libevent base, not a reactor"
+            raise PycbException(LCB_ERROR, errMsg)
 
-        result = self.removeResult
-        if result is None:
-            errMsg = "did not get remove_callback"
+        stream = pylcb.RowStream()
+        pylcb.make_http_request(self.instance, stream, LCB_HTTP_TYPE_VIEW,
+                                _view_path(view, params), "",
+                                LCB_HTTP_METHOD_GET, 1, "application/json")
+        try:
+            while True:
+                pylcb.run_event_loop_once(self.evbase)
+                for row in stream.take_rows():
+                    yield json.loads(row)
+                if stream.done:
+                    break
+        finally:
+            # a reader that stops early does not leave the response
+            # streaming in
+            if not stream.done:
+                pylcb.cancel_http_request(self.instance, stream)
+            stream.close()
+
+        _check_view(stream.error, stream.status, stream.rest)
+
+    def view_pages(self, view, pageSize=100, **params):
+        """
+        Generator over the pages of a view, each a list of at most
+        pageSize rows.  Every request asks for one extra row, whose key
+        and document id are where the next page starts, so pages are
+        fetched by key rather than with a growing skip.  Rows of a
+        grouped reduce have no document id and continue from the key
+        alone.
+
+        The request for the next page is scheduled before the current
+        page is handed out, so it progresses during any wait on the
+        connection while the caller works on the page, and is collected
+        when the next page is asked for.
+        """
+        params['limit'] = pageSize + 1
+        pending = self._view_request(view, params)
+        while pending is not None:
+            rows = self._view_rows(pending)
+            pending = None
+            if len(rows) > pageSize:
+                params['startkey'] = rows[pageSize]['key']
+                if 'id' in rows[pageSize]:
+                    params['startkey_docid'] = rows[pageSize]['id']
+                else:
+                    params.pop('startkey_docid', None)
+                params.pop('skip', None)
+                pending = self._view_request(view, params)
+            if rows:
+                yield rows[:pageSize]
+
+    def view_multi(self, queries):
+        """
+        Send many view queries at once and wait for all of them together.
+
+        queries is a list of (view, params) tuples.  Returns a list with,
+        in the same order, the rows of each query or the exception view()
+        would have raised for it.
+        """
+        cookies = [self._view_request(view, params)
+                   for view, params in queries]
+        self._wait()
+
+        rows = []
+        for results in cookies:
+            try:
+                rows.append(self._view_rows(results))
+            except PycbException as e:
+                rows.append(e)
+        return rows
+
+    def _view_request(self, view, params):
+        results = []
+        pylcb.make_http_request(self.instance, results, LCB_HTTP_TYPE_VIEW,
+                                _view_path(view, dict(params)), "",
+                                LCB_HTTP_METHOD_GET, 0, "application/json")
+        return results
+
+    def _view_rows(self, results):
+        if not results:
+            self._wait()
+        if not results:
+            errMsg = "did not get http_complete_callback"
             raise PycbException(LCB_ERROR, errMsg)
 
-        error = result['error']
-        if error == LCB_SUCCESS:
-            return True
+        result = results[0]
+        _check_view(result.error, result.status, result.value)
+        return json.loads(result.value).get('rows', [])
 
-        errMsg = "error deleting key, %s" % pylcb.strerror(result['error'])
-        if error == LCB_KEY_ENOENT:
-            raise PycbKeyNotFound(error, errMsg)
-        else:
-            raise PycbException(result['error'], errMsg)
 
-    def incr(self, key, amt=1, init=0, exp=0):
-        return self._arithmetic(key, amt, init, exp)
+class Pipeline(object):
+    """
+    Queues get, store, delete and arithmetic operations against a bucket
+    and sends them all with a single wait when the with block exits:
 
-    def decr(self, key, amt=1, init=0, exp=0):
-        return self._arithmetic(key, -amt, init, exp)
+        with bucket.pipeline() as pipe:
+            pipe.get("a")
+            pipe.set("b", 0, 0, "value")
+            pipe.incr("c")
+        flags, cas, a = pipe.results[0]
 
-    def _arithmetic(self, key, delta, initial, expiration):
-        self.arithmeticResult = None
-        pylcb.arithmetic(self.instance, self, key, delta, initial, expiration)
-        pylcb.wait(self.instance)
+    Every operation gets its own result list as cookie, so responses are
+    matched to their request even when a key is used more than once.
+    results holds, in submission order, what the equivalent Bucket method
+    would have returned, or the exception it would have raised.
+    """
 
-        result = self.arithmeticResult
-        if result is None:
-            errMsg = "did not get arithmetic_callback"
-            raise PycbException(LCB_ERROR, errMsg)
+    def __init__(self, bucket):
+        self.bucket = bucket
+        self.operations = []
+        self.results = None
 
-        error = result['error']
-        if error == LCB_SUCCESS:
-            return result['value']
+    def __enter__(self):
+        return self
 
-        errMsg = "error incrementing/decrementing key, %s" \
-                 % pylcb.strerror(result['error'])
-        raise PycbException(result['error'], errMsg)
+    def __exit__(self, exc_type, exc_value, traceback):
+        if exc_type is None:
+            self.execute()
 
-    def stats(self, name=""):
-        self.statsResults = []
-        pylcb.stats(self.instance, self, name)
-        pylcb.wait(self.instance)
+    def add(self, key, exp, flags, val):
+        self._store(key, exp, flags, val, LCB_ADD)
 
-        return self.statsResults
+    def replace(self, key, exp, flags, val, cas=0):
+        self._store(key, exp, flags, val, LCB_REPLACE, cas)
 
-    def flush(self):
-        self.flushResults = []
+    def set(self, key, expiration, flags, value, cas=0):
+        self._store(key, expiration, flags, value, LCB_SET, cas)
 
-        pylcb.flush(self.instance, self)
-        pylcb.wait(self.instance)
+    def append(self, key, value, cas=0):
+        self._store(key, 0, 0, value, LCB_APPEND, cas)
 
-        return self.flushResults
+    def prepend(self, key, value, cas=0):
+        self._store(key, 0, 0, value, LCB_PREPEND, cas)
 
-    def view(self, view, **params):
-        for param in params:
-            if param in ["key", "keys", "startkey", "endkey"]:
-                value = json.dumps(params[param])
-                params[param] = value
-
-        path = view
-        if len(params) > 0:
-            path += "?%s" % urllib.urlencode(params)
-
-        pylcb.make_http_request(
-            self.instance,
-            None,
-            LCB_HTTP_TYPE_VIEW,
-            path,
-            "",
-            LCB_HTTP_METHOD_GET,
-            0,
-            "application/json"
-        )
-        pylcb.wait(self.instance)
+    def _store(self, key, expiration, flags, value, operation, cas=0):
+        self._queue(_store_value, "store_callback", pylcb.store,
+                    key, expiration, flags, value, operation, cas)
 
-        # raise exception if http request failed
-        if self.httpResult['error'] != LCB_SUCCESS:
-            errMsg = "get view, error:%s" % \
-                     pylcb.pylcb_strerror(self.httpResult['error'])
-            raise PycbException(self.httpResult['error'], errMsg)
+    def get(self, key):
+        self._queue(_get_value, "get_callback", pylcb.get, key)
 
-        # raise exception if http request was successful but status
-        # is not 200 or 201
-        if self.httpResult['status'] not in [200, 201]:
-            errMsg = "get view, status:%s, response:%s" % \
-                     (self.httpResult['status'], self.httpResult['bytes'])
-            raise PycbException(self.httpResult['error'], errMsg)
+    def delete(self, key, cas=0):
+        self._queue(_remove_value, "remove_callback", pylcb.remove,
+                    key, cas)
 
-        response = json.loads(self.httpResult['bytes'])
-        if 'rows' in response:
-            return response['rows']
+    def incr(self, key, amt=1, init=0, exp=0):
+        self._queue(_arithmetic_value, "arithmetic_callback",
+                    pylcb.arithmetic, key, amt, init, exp)
+
+    def decr(self, key, amt=1, init=0, exp=0):
+        self._queue(_arithmetic_value, "arithmetic_callback",
+                    pylcb.arithmetic, key, -amt, init, exp)
+
+    def _queue(self, interpret, callbackName, schedule, *args):
+        self.operations.append((interpret, callbackName, schedule, args))
+
+    def execute(self):
+        operations = self.operations
+        self.operations = []
+
+        cookies = []
+        try:
+            for interpret, callbackName, schedule, args in operations:
+                cookie = []
+                cookies.append(cookie)
+                schedule(self.bucket.instance, cookie, *args)
+        except Exception:
+            # the operations already scheduled complete before the error
+            # is raised, so none is left in flight
+            excInfo = sys.exc_info()
+            self.bucket._wait()
+            raise excInfo[0], excInfo[1], excInfo[2]
+        self.bucket._wait()
+
+        self.results = []
+        for cookie, operation in zip(cookies, operations):
+            interpret, callbackName = operation[:2]
+            if not cookie:
+                errMsg = "did not get %s" % callbackName
+                self.results.append(PycbException(LCB_ERROR, errMsg))
+            else:
+                self.results.append(interpret(cookie[0]))
+
+        return self.results
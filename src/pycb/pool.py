@@ -0,0 +1,220 @@
+import threading
+import time
+
+from .couchbase import PycbException, PycbKeyNotFound, LCB_ERROR, \
+    LCB_ETIMEDOUT
+
+
+# one pool per (host, username, password, bucket, timeout), shared by
+# every Couchbase object of the process
+_pools = {}
+_poolsLock = threading.Lock()
+
+
+def get_pool(key, factory, **options):
+    """
+    Return the pool registered under key, creating it with factory and
+    options when there is none yet.  options only apply at creation.
+    """
+    with _poolsLock:
+        pool = _pools.get(key)
+        if pool is None:
+            pool = ConnectionPool(factory, **options)
+            _pools[key] = pool
+        return pool
+
+
+def check_bucket(bucket):
+    """
+    Default health check: a connection is healthy when a get reaches the
+    cluster, whether or not the probe key exists.
+    """
+    try:
+        bucket.get("pycb:healthcheck")
+    except PycbKeyNotFound:
+        pass
+    except PycbException:
+        return False
+    return True
+
+
+class _Pin(object):
+    """
+    A connection pinned to a thread, and when it last passed a health
+    check.
+    """
+
+    def __init__(self, thread, connection):
+        self.thread = thread
+        self.connection = connection
+        self.lastChecked = time.time()
+
+
+class ConnectionPool(object):
+    """
+    Thread-safe pool of ready connections made by factory.
+
+    At least minSize connections are kept open and at most maxSize exist
+    at once; checkouts beyond that block until one is released, or raise
+    after checkoutTimeout seconds.  Idle connections above minSize are
+    closed after idleTimeout seconds, and a connection that was idle for
+    more than checkInterval seconds passes healthCheck before it is handed
+    out again.
+
+    connection() checks one out for a with block.  thread_connection()
+    pins one to the calling thread for its lifetime, so hot paths that
+    call it per request never connect again; it is health checked every
+    checkInterval seconds and goes back to the pool once the thread has
+    exited.  A checkout that could only be served by a connection pinned
+    to a live thread raises rather than wait forever, so maxSize must
+    cover the threads that pin one.
+    """
+
+    def __init__(self, factory, minSize=0, maxSize=10, idleTimeout=300,
+                 checkInterval=30, healthCheck=check_bucket,
+                 checkoutTimeout=None):
+        self.factory = factory
+        self.minSize = minSize
+        self.maxSize = max(maxSize, minSize, 1)
+        self.idleTimeout = idleTimeout
+        self.checkInterval = checkInterval
+        self.healthCheck = healthCheck
+        self.checkoutTimeout = checkoutTimeout
+
+        self.lock = threading.Condition()
+        self.idle = []      # (connection, lastUsed), most recent last
+        self.pins = {}      # thread ident -> _Pin
+        self.size = 0       # connections open, idle, pinned or checked out
+
+        for i in range(minSize):
+            with self.lock:
+                self.size += 1
+            self.idle.append((self._create(), time.time()))
+
+    def _create(self):
+        # the caller has already counted the connection in size
+        try:
+            return self.factory()
+        except:
+            self._discard()
+            raise
+
+    def _discard(self):
+        with self.lock:
+            self.size -= 1
+            self.lock.notify()
+
+    def _evict_idle(self):
+        # called with the lock held; the oldest idle connections come first
+        expired = time.time() - self.idleTimeout
+        while len(self.idle) > self.minSize and self.idle[0][1] < expired:
+            self.idle.pop(0)
+            self.size -= 1
+
+    def _reclaim_pins(self):
+        # called with the lock held; pins of exited threads become idle
+        for ident, pin in list(self.pins.items()):
+            if not pin.thread.is_alive():
+                del self.pins[ident]
+                self.idle.append((pin.connection, pin.lastChecked))
+
+    def acquire(self):
+        if self.checkoutTimeout is not None:
+            deadline = time.time() + self.checkoutTimeout
+
+        with self.lock:
+            while True:
+                self._evict_idle()
+                if not self.idle and self.size >= self.maxSize:
+                    self._reclaim_pins()
+                if self.idle:
+                    connection, lastUsed = self.idle.pop()
+                    break
+                if self.size < self.maxSize:
+                    # reserve the slot before connecting outside the lock
+                    self.size += 1
+                    connection = None
+                    break
+                if len(self.pins) >= self.size:
+                    errMsg = "all %d connections are pinned to running " \
+                             "threads" % self.size
+                    raise PycbException(LCB_ERROR, errMsg)
+
+                if self.checkoutTimeout is None:
+                    self.lock.wait()
+                else:
+                    remaining = deadline - time.time()
+                    if remaining <= 0:
+                        errMsg = "no connection available within %s " \
+                                 "seconds" % self.checkoutTimeout
+                        raise PycbException(LCB_ETIMEDOUT, errMsg)
+                    self.lock.wait(remaining)
+
+        if connection is None:
+            return self._create()
+
+        if self.healthCheck is not None and \
+                time.time() - lastUsed > self.checkInterval:
+            if not self.healthCheck(connection):
+                # the unhealthy connection's slot goes to its replacement
+                return self._create()
+
+        return connection
+
+    def release(self, connection, healthy=True):
+        with self.lock:
+            if healthy:
+                self.idle.append((connection, time.time()))
+                self.lock.notify()
+            else:
+                self.size -= 1
+                self.lock.notify()
+
+    def connection(self):
+        return _Checkout(self)
+
+    def thread_connection(self):
+        thread = threading.current_thread()
+        with self.lock:
+            pin = self.pins.get(thread.ident)
+            if pin is not None and pin.thread is not thread:
+                # left by an exited thread whose ident was reused
+                del self.pins[thread.ident]
+                self.idle.append((pin.connection, pin.lastChecked))
+                pin = None
+
+        if pin is not None and self.healthCheck is not None and \
+                time.time() - pin.lastChecked > self.checkInterval:
+            if self.healthCheck(pin.connection):
+                pin.lastChecked = time.time()
+            else:
+                with self.lock:
+                    del self.pins[thread.ident]
+                self.release(pin.connection, healthy=False)
+                pin = None
+
+        if pin is None:
+            pin = _Pin(thread, self.acquire())
+            with self.lock:
+                self.pins[thread.ident] = pin
+        return pin.connection
+
+
+class _Checkout(object):
+    def __init__(self, pool):
+        self.pool = pool
+        self.connection = None
+
+    def __enter__(self):
+        self.connection = self.pool.acquire()
+        return self.connection
+
+    def __exit__(self, exc_type, exc_value, traceback):
+        # a connection that saw a cluster error is checked before reuse
+        healthy = True
+        if isinstance(exc_value, PycbException) and \
+                not isinstance(exc_value, PycbKeyNotFound) and \
+                self.pool.healthCheck is not None:
+            healthy = self.pool.healthCheck(self.connection)
+        self.pool.release(self.connection, healthy)
+        self.connection = None
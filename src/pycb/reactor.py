@@ -0,0 +1,144 @@
+import datetime
+
+import pylcb
+
+# libcouchbase io event flags
+LCB_READ_EVENT = 0x02
+LCB_WRITE_EVENT = 0x04
+
+
+class SharedEventBase(object):
+    """
+    One libevent base shared by many buckets.  Pass it as reactor to
+    Couchbase.bucket() for each bucket, then wait() on several of them at
+    once: their operations run in the same loop turns, so the wait takes as
+    long as the slowest bucket instead of the sum of all of them.
+
+    A libevent base is not thread-safe; share one per thread.
+    """
+
+    def __init__(self):
+        self.evbase = pylcb.create_event_base()
+
+    def wait(self, *buckets):
+        pylcb.wait_multi([bucket.instance for bucket in buckets])
+
+    def run_nonblock(self):
+        pylcb.run_event_loop_nonblock(self.evbase)
+
+    def running(self):
+        # the loop only runs inside wait(), never underneath the caller
+        return False
+
+
+class AsyncioReactor(object):
+    """
+    Runs libcouchbase on an asyncio (or trollius) event loop.  Pass it as
+    reactor to Couchbase.bucket() and the bucket's sockets and timers are
+    registered with the loop instead of a private libevent base.
+    """
+
+    def __init__(self, loop=None):
+        try:
+            import asyncio
+        except ImportError:
+            import trollius as asyncio
+        self.asyncio = asyncio
+        if loop is None:
+            loop = asyncio.get_event_loop()
+        self.loop = loop
+
+    def watch(self, fd, flags, callback):
+        self.unwatch(fd)
+        if flags & LCB_READ_EVENT:
+            self.loop.add_reader(fd, callback, LCB_READ_EVENT)
+        if flags & LCB_WRITE_EVENT:
+            self.loop.add_writer(fd, callback, LCB_WRITE_EVENT)
+
+    def unwatch(self, fd):
+        self.loop.remove_reader(fd)
+        self.loop.remove_writer(fd)
+
+    def schedule(self, usec, callback):
+        return self.loop.call_later(usec / 1000000.0, callback)
+
+    def cancel(self, handle):
+        handle.cancel()
+
+    def running(self):
+        return self.loop.is_running()
+
+    def create_future(self):
+        return self.asyncio.Future(loop=self.loop)
+
+    def run(self):
+        self.loop.run_forever()
+
+    def stop(self):
+        self.loop.stop()
+
+
+class TornadoReactor(object):
+    """
+    Runs libcouchbase on a Tornado IOLoop.  Pass it as reactor to
+    Couchbase.bucket() and the bucket's sockets and timers are registered
+    with the IOLoop instead of a private libevent base.
+    """
+
+    def __init__(self, ioloop=None):
+        from tornado.ioloop import IOLoop
+        self.IOLoop = IOLoop
+        if ioloop is None:
+            ioloop = IOLoop.current()
+        self.ioloop = ioloop
+        self.handlers = set()
+
+    def watch(self, fd, flags, callback):
+        # an IOLoop handler can not be replaced, only its events updated
+        self.unwatch(fd)
+
+        events = self.IOLoop.ERROR
+        if flags & LCB_READ_EVENT:
+            events |= self.IOLoop.READ
+        if flags & LCB_WRITE_EVENT:
+            events |= self.IOLoop.WRITE
+
+        def handler(fd, events):
+            which = 0
+            if events & (self.IOLoop.READ | self.IOLoop.ERROR):
+                which |= LCB_READ_EVENT
+            if events & (self.IOLoop.WRITE | self.IOLoop.ERROR):
+                which |= LCB_WRITE_EVENT
+            callback(which & flags)
+
+        self.ioloop.add_handler(fd, handler, events)
+        self.handlers.add(fd)
+
+    def unwatch(self, fd):
+        if fd in self.handlers:
+            self.ioloop.remove_handler(fd)
+            self.handlers.discard(fd)
+
+    def schedule(self, usec, callback):
+        return self.ioloop.add_timeout(
+            datetime.timedelta(microseconds=usec), callback)
+
+    def cancel(self, handle):
+        self.ioloop.remove_timeout(handle)
+
+    def running(self):
+        # tornado >= 5 runs on top of an asyncio loop
+        loop = getattr(self.ioloop, 'asyncio_loop', None)
+        if loop is not None:
+            return loop.is_running()
+        return getattr(self.ioloop, '_running', False)
+
+    def create_future(self):
+        from tornado.concurrent import Future
+        return Future()
+
+    def run(self):
+        self.ioloop.start()
+
+    def stop(self):
+        self.ioloop.stop()
@@ -0,0 +1,65 @@
+import copy
+import threading
+
+
+class _Call(object):
+    def __init__(self):
+        self.done = threading.Event()
+        self.result = None
+        self.exception = None
+
+
+class SingleFlight(object):
+    """
+    Coalesces identical requests in flight at the same time.  The first
+    caller of do() for a key runs the request, callers arriving before it
+    completes wait for it and get its result, or its exception, instead
+    of sending their own.
+
+    Followers get a deep copy of the result, so a document one caller
+    modifies is not seen changed by the others.
+
+    A caller joining a request that was sent before its own write gets
+    the value from before the write: coalesced reads give up
+    read-your-writes for as long as one request is in flight.
+    """
+
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.calls = {}
+        self.leaders = 0    # requests sent
+        self.followers = 0  # requests answered by another caller's
+
+    def do(self, key, fn, *args):
+        with self.lock:
+            call = self.calls.get(key)
+            if call is None:
+                call = _Call()
+                self.calls[key] = call
+                self.leaders += 1
+                leader = True
+            else:
+                self.followers += 1
+                leader = False
+
+        if not leader:
+            call.done.wait()
+            if call.exception is not None:
+                raise call.exception
+            return copy.deepcopy(call.result)
+
+        try:
+            call.result = fn(*args)
+        except Exception as e:
+            call.exception = e
+            raise
+        finally:
+            with self.lock:
+                del self.calls[key]
+            call.done.set()
+        return call.result
+
+    def stats(self):
+        with self.lock:
+            return dict(leaders=self.leaders, followers=self.followers,
+                        inflight=len(self.calls))
@@ -0,0 +1,271 @@
+import atexit
+import threading
+import weakref
+
+import pylcb
+
+from .couchbase import PycbException, LCB_ERROR, LCB_SET, LCB_ETMPFAIL
+from .couchbase import LCB_NETWORK_ERROR, LCB_ETIMEDOUT
+from .couchbase import _store_value, _arithmetic_value
+
+
+# failures worth writing again at the next flush.  A delta is only sent
+# again when the server refused it, since after a timeout it may have
+# been applied
+_RETRY_SET = (LCB_ETMPFAIL, LCB_NETWORK_ERROR, LCB_ETIMEDOUT)
+_RETRY_DELTA = (LCB_ETMPFAIL,)
+
+# writers not closed yet, closed by a single hook at interpreter exit
+# without keeping them alive
+_open = weakref.WeakSet()
+
+
+@atexit.register
+def _close_all():
+    for writer in list(_open):
+        writer.close()
+
+
+_INT32 = 2 ** 31
+_UINT32 = 2 ** 32
+_INT64 = 2 ** 63
+_UINT64 = 2 ** 64
+
+
+def _check_integer(name, value, low, high):
+    # checked when buffered, since a value the extension rejects would
+    # fail every flush
+    if not isinstance(value, (int, long)):
+        raise TypeError("%s must be an integer" % name)
+    if not low <= value < high:
+        raise OverflowError("%s out of range" % name)
+
+
+class WriteBehind(object):
+    """
+    Buffers incr, decr and set calls and writes them in the background
+    every interval seconds, on its own connection made by factory:
+
+        counters = cb.write_behind("metrics")
+        counters.incr("requests")
+
+    Deltas to the same key are summed and written as one arithmetic per
+    key and flush, and of several sets of a key only the last value is
+    written.  A set drops the deltas buffered before it, and deltas
+    buffered after a set are applied on top of it.  Nothing is returned
+    to the caller; errors of the last writes are kept in errors, and
+    writes failing with a temporary error are kept for the next flush.
+
+    flush() writes everything buffered so far.  close(), also called
+    when the with block or the interpreter exits, stops the background
+    writes and flushes a last time.
+    """
+
+    def __init__(self, factory, interval=1.0):
+        self.factory = factory
+        self.interval = interval
+        self.bucket = None      # made by the first flush
+
+        self.lock = threading.Lock()
+        self.deltas = {}        # key -> [delta, initial, expiration]
+        self.sets = {}          # key -> (expiration, flags, value)
+        self.closed = False
+        self.operations = 0     # calls buffered
+        self.writes = 0         # commands sent for them
+
+        self.flushLock = threading.Lock()
+        self.errors = {}        # key -> exception of its last write
+
+        self.stopped = threading.Event()
+        self.thread = threading.Thread(target=self._run)
+        self.thread.daemon = True
+        self.thread.start()
+        _open.add(self)
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, exc_type, exc_value, traceback):
+        self.close()
+
+    def incr(self, key, amt=1, init=0, exp=0):
+        self._add(key, amt, init, exp)
+
+    def decr(self, key, amt=1, init=0, exp=0):
+        self._add(key, -amt, init, exp)
+
+    def _add(self, key, delta, initial, expiration):
+        _check_integer("delta", delta, -_INT64, _INT64)
+        _check_integer("init", initial, 0, _UINT64)
+        _check_integer("exp", expiration, 0, _INT32)
+        with self.lock:
+            self._check_open(key)
+            pending = self.deltas.get(key)
+            if pending is None:
+                self.deltas[key] = [delta, initial, expiration]
+            else:
+                _check_integer("delta", pending[0] + delta,
+                               -_INT64, _INT64)
+                pending[0] += delta
+            self.operations += 1
+
+    def set(self, key, expiration, flags, value):
+        _check_integer("expiration", expiration, 0, _INT32)
+        _check_integer("flags", flags, 0, _UINT32)
+        with self.lock:
+            self._check_open(key)
+            self.operations += 1
+            self.deltas.pop(key, None)
+            self.sets[key] = (expiration, flags, value)
+
+    def _check_open(self, key):
+        if self.closed:
+            raise PycbException(LCB_ERROR, "write-behind buffer is closed")
+        # a key that can not be sent would fail every flush
+        if not isinstance(key, basestring):
+            raise TypeError("key must be a string")
+        if isinstance(key, unicode):
+            key.encode('ascii')
+
+    def stats(self):
+        with self.lock:
+            return dict(operations=self.operations, writes=self.writes,
+                        pending=len(self.deltas) + len(self.sets))
+
+    def flush(self):
+        """
+        Write everything buffered, and return a dict mapping each key
+        whose write failed to the exception.
+        """
+        with self.flushLock:
+            with self.lock:
+                deltas, self.deltas = self.deltas, {}
+                sets, self.sets = self.sets, {}
+                self.writes += len(deltas) + len(sets)
+            if not deltas and not sets:
+                return {}
+
+            try:
+                if self.bucket is None:
+                    self.bucket = self.factory()
+            except Exception:
+                # nothing was sent, the writes are attempted again
+                self._requeue(deltas, sets)
+                raise
+
+            try:
+                setErrors, deltaErrors = self._write(deltas, sets)
+            except Exception:
+                # the connection failed.  Whatever is in flight completes
+                # before it is dropped; the sets are written again, but
+                # the deltas may have been applied
+                try:
+                    pylcb.wait(self.bucket.instance)
+                except Exception:
+                    pass
+                self.bucket = None
+                self._requeue({}, sets)
+                errMsg = "write-behind connection failed, delta may " \
+                         "have been applied"
+                self.errors.update((key, PycbException(LCB_ERROR, errMsg))
+                                   for key in deltas)
+                raise
+
+            self._requeue(dict((key, deltas[key])
+                               for key, error in deltaErrors.iteritems()
+                               if error.error in _RETRY_DELTA),
+                          dict((key, sets[key])
+                               for key, error in setErrors.iteritems()
+                               if error.error in _RETRY_SET))
+            errors = dict(setErrors)
+            errors.update(deltaErrors)
+            self.errors.update(errors)
+            return errors
+
+    def _write(self, deltas, sets):
+        instance = self.bucket.instance
+
+        # the sets are sent first, so deltas buffered after a set of the
+        # same key apply on top of it
+        setErrors = {}
+        deltaErrors = {}
+        setResults = {}
+        commands = [(key,) + command for key, command in sets.iteritems()]
+        try:
+            pylcb.store_multi(instance, setResults, commands, LCB_SET)
+        except Exception:
+            # only the value that can not be encoded is lost
+            for command in commands:
+                try:
+                    pylcb.store(instance, setResults, *(command + (LCB_SET,)))
+                except Exception as e:
+                    setErrors[command[0]] = PycbException(LCB_ERROR, str(e))
+
+        arithmeticResults = {}
+        commands = [(key,) + tuple(pending)
+                    for key, pending in deltas.iteritems()]
+        try:
+            pylcb.arithmetic_multi(instance, arithmeticResults, commands)
+        except Exception:
+            for command in commands:
+                try:
+                    pylcb.arithmetic_multi(instance, arithmeticResults,
+                                           [command])
+                except Exception as e:
+                    deltaErrors[command[0]] = PycbException(LCB_ERROR,
+                                                            str(e))
+        pylcb.wait(instance)
+
+        for keys, results, errors, interpret, callbackName in [
+                (sets, setResults, setErrors, _store_value,
+                 "store_callback"),
+                (deltas, arithmeticResults, deltaErrors, _arithmetic_value,
+                 "arithmetic_callback")]:
+            for key in keys:
+                if key in errors:
+                    continue
+                result = results.get(key)
+                if result is None:
+                    errMsg = "did not get %s" % callbackName
+                    errors[key] = PycbException(LCB_ERROR, errMsg)
+                    continue
+                value = interpret(result)
+                if isinstance(value, PycbException):
+                    errors[key] = value
+                else:
+                    self.errors.pop(key, None)
+        return setErrors, deltaErrors
+
+    def _requeue(self, deltas, sets):
+        # merged under whatever was buffered since the flush started
+        with self.lock:
+            for key, (delta, initial, expiration) in deltas.iteritems():
+                if key in self.sets:
+                    continue
+                pending = self.deltas.get(key)
+                if pending is None:
+                    self.deltas[key] = [delta, initial, expiration]
+                else:
+                    pending[0] += delta
+            for key, command in sets.iteritems():
+                if key not in self.sets:
+                    self.sets[key] = command
+
+    def _run(self):
+        while not self.stopped.wait(self.interval):
+            try:
+                self.flush()
+            except Exception:
+                pass
+
+    def close(self):
+        with self.lock:
+            if self.closed:
+                return
+            self.closed = True
+        _open.discard(self)
+        self.stopped.set()
+        if self.thread is not threading.current_thread():
+            self.thread.join()
+        self.flush()
+        self.bucket = None
@@ -1,17 +1,28 @@
+#define PY_SSIZE_T_CLEAN
 #include <Python.h>
+#include <structseq.h>
+#include <structmember.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/time.h>
 #include <libcouchbase/couchbase.h>
 #include <event.h>
+#include <zlib.h>
 
 
 /* ---------------------------------------------------
     Create a libevent event base that can be passed
     to lcb_create.
-    
-    This should be a temporary hack until we can
-    build a tornado ioloop plugin
+
+    This is the default IO for instances that are not
+    driven by a host event loop through the reactor IO
+    ops below.
    ---------------------------------------------------*/
 
 static PyObject *
@@ -22,6 +33,28 @@ pylcb_create_event_base(PyObject *self, PyObject *args) {
     return PyCapsule_New(evbase, "event_base", NULL);
 }
 
+/* block until at least one event fired and run its callbacks, so a
+   caller can consume results as they arrive instead of after lcb_wait */
+static PyObject *
+pylcb_run_event_loop_once(PyObject *self, PyObject *args) {
+    PyObject *capsule;
+    struct event_base *evbase;
+
+    if (!PyArg_ParseTuple(args, "O", &capsule)) {
+        return NULL;
+    }
+    evbase = PyCapsule_GetPointer(capsule, "event_base");
+    if (!evbase) {
+        return NULL;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    event_base_loop(evbase, EVLOOP_ONCE);
+    Py_END_ALLOW_THREADS
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
 static PyObject *
 pylcb_run_event_loop_nonblock(PyObject *self, PyObject *args) {
     PyObject *capsule;
@@ -31,21 +64,474 @@ pylcb_run_event_loop_nonblock(PyObject *self, PyObject *args) {
         return NULL;
     }
     evbase = PyCapsule_GetPointer(capsule, "event_base");
+    Py_BEGIN_ALLOW_THREADS
     event_base_loop(evbase, 2);
+    Py_END_ALLOW_THREADS
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/* ---------------------------------------------------
+    Reactor IO ops.
+
+    An lcb_io_opt_st implementation that registers
+    sockets and timers with a python reactor object,
+    so libcouchbase is driven by a host event loop
+    (asyncio, tornado) instead of blocking it.  See
+    pycb/reactor.py.  A reactor implements:
+
+        watch(fd, flags, callback)    callback(which)
+        unwatch(fd)
+        schedule(usec, callback)      returns a handle
+        cancel(handle)
+        run()
+        stop()
+
+    The io ops functions may be called with or without
+    the GIL held (lcb_wait releases it), so each one
+    takes it with PyGILState_Ensure.
+   ---------------------------------------------------*/
+
+/* An event or timer.  It is owned by the capsule behind its python
+   callback, so it stays valid while the host loop still references the
+   callback after libcouchbase destroyed it; handler is NULL from then. */
+struct reactor_event {
+    lcb_socket_t sock;
+    short flags;            /* flags being watched, 0 when not watched */
+    void *cb_data;
+    void (*handler)(lcb_socket_t sock, short which, void *cb_data);
+    PyObject *callback;     /* callable handed to the reactor */
+    PyObject *handle;       /* handle of a scheduled timer */
+};
+
+
+static PyObject *
+reactor_event_fired(PyObject *capsule, PyObject *args)
+{
+    struct reactor_event *event;
+    int which = 0;
+
+    if (!PyArg_ParseTuple(args, "|i", &which)) {
+        return NULL;
+    }
+    event = PyCapsule_GetPointer(capsule, "reactor_event");
+
+    /* a timer fires once */
+    Py_CLEAR(event->handle);
+
+    if (event->handler) {
+        /* the handler may destroy the event */
+        Py_INCREF(capsule);
+        event->handler(event->sock, which, event->cb_data);
+        Py_DECREF(capsule);
+    }
 
     Py_INCREF(Py_None);
     return Py_None;
 }
 
-/* -------------------------------------------------
-    end temporary hack awaiting tornado ioloop
-    plugin
-   ------------------------------------------------- */
+
+static PyMethodDef reactor_event_def = {
+    "fired", reactor_event_fired, METH_VARARGS,
+    "Called by the reactor when a watched socket or timer is ready"
+};
+
+
+static void
+reactor_event_destructor(PyObject *capsule)
+{
+    struct reactor_event *event;
+
+    event = PyCapsule_GetPointer(capsule, "reactor_event");
+    Py_XDECREF(event->handle);
+    free(event);
+}
+
+
+static PyObject *
+reactor_call(struct lcb_io_opt_st *iops, const char *method,
+             const char *format, ...)
+{
+    PyObject *reactor = iops->v.v0.cookie;
+    PyObject *callable;
+    PyObject *args;
+    PyObject *result = NULL;
+    va_list va;
+
+    callable = PyObject_GetAttrString(reactor, method);
+    if (callable) {
+        va_start(va, format);
+        args = Py_VaBuildValue(format, va);
+        va_end(va);
+        if (args) {
+            result = PyObject_CallObject(callable, args);
+            Py_DECREF(args);
+        }
+        Py_DECREF(callable);
+    }
+    if (!result) {
+        PyErr_WriteUnraisable(reactor);
+    }
+    return result;
+}
+
+
+static void *
+reactor_create_event(struct lcb_io_opt_st *iops)
+{
+    struct reactor_event *event;
+    PyObject *capsule;
+    PyGILState_STATE gstate;
+
+    gstate = PyGILState_Ensure();
+    event = calloc(1, sizeof(struct reactor_event));
+    if (event) {
+        event->sock = -1;
+        capsule = PyCapsule_New(event, "reactor_event",
+                                reactor_event_destructor);
+        if (!capsule) {
+            free(event);
+            event = NULL;
+        } else {
+            event->callback = PyCFunction_New(&reactor_event_def, capsule);
+            if (!event->callback) {
+                event = NULL;   /* freed with the capsule */
+            }
+            Py_DECREF(capsule);
+        }
+    }
+    if (!event) {
+        PyErr_Clear();
+        iops->v.v0.error = ENOMEM;
+    }
+    PyGILState_Release(gstate);
+    return event;
+}
+
+
+static void
+reactor_unwatch(struct lcb_io_opt_st *iops, struct reactor_event *event)
+{
+    PyObject *result;
+
+    if (event->flags) {
+        result = reactor_call(iops, "unwatch", "(i)", event->sock);
+        Py_XDECREF(result);
+        event->flags = 0;
+    }
+}
+
+
+static void
+reactor_cancel(struct lcb_io_opt_st *iops, struct reactor_event *event)
+{
+    PyObject *result;
+
+    if (event->handle) {
+        result = reactor_call(iops, "cancel", "(O)", event->handle);
+        Py_XDECREF(result);
+        Py_CLEAR(event->handle);
+    }
+}
+
+
+static int
+reactor_update_event(struct lcb_io_opt_st *iops,
+                     lcb_socket_t sock,
+                     void *ev,
+                     short flags,
+                     void *cb_data,
+                     void (*handler)(lcb_socket_t sock, short which,
+                                     void *cb_data))
+{
+    struct reactor_event *event = ev;
+    PyObject *result;
+    PyGILState_STATE gstate;
+    int rc = 0;
+
+    gstate = PyGILState_Ensure();
+    event->cb_data = cb_data;
+    event->handler = handler;
+    if (event->sock != sock) {
+        reactor_unwatch(iops, event);
+        event->sock = sock;
+    }
+    if (event->flags != flags) {
+        result = reactor_call(iops, "watch", "(iiO)", sock, flags,
+                              event->callback);
+        if (result) {
+            Py_DECREF(result);
+            event->flags = flags;
+        } else {
+            rc = -1;
+        }
+    }
+    PyGILState_Release(gstate);
+    return rc;
+}
+
+
+static void
+reactor_delete_event(struct lcb_io_opt_st *iops, lcb_socket_t sock, void *ev)
+{
+    PyGILState_STATE gstate;
+
+    gstate = PyGILState_Ensure();
+    reactor_unwatch(iops, ev);
+    PyGILState_Release(gstate);
+}
+
+
+static void
+reactor_destroy_event(struct lcb_io_opt_st *iops, void *ev)
+{
+    struct reactor_event *event = ev;
+    PyGILState_STATE gstate;
+
+    gstate = PyGILState_Ensure();
+    reactor_unwatch(iops, event);
+    reactor_cancel(iops, event);
+    event->handler = NULL;
+    Py_DECREF(event->callback);     /* may free event */
+    PyGILState_Release(gstate);
+}
+
+
+static int
+reactor_update_timer(struct lcb_io_opt_st *iops,
+                     void *ev,
+                     lcb_uint32_t usec,
+                     void *cb_data,
+                     void (*handler)(lcb_socket_t sock, short which,
+                                     void *cb_data))
+{
+    struct reactor_event *event = ev;
+    PyGILState_STATE gstate;
+    int rc = 0;
+
+    gstate = PyGILState_Ensure();
+    reactor_cancel(iops, event);
+    event->cb_data = cb_data;
+    event->handler = handler;
+    event->handle = reactor_call(iops, "schedule", "(kO)",
+                                 (unsigned long) usec, event->callback);
+    if (!event->handle) {
+        rc = -1;
+    }
+    PyGILState_Release(gstate);
+    return rc;
+}
+
+
+static void
+reactor_delete_timer(struct lcb_io_opt_st *iops, void *ev)
+{
+    PyGILState_STATE gstate;
+
+    gstate = PyGILState_Ensure();
+    reactor_cancel(iops, ev);
+    PyGILState_Release(gstate);
+}
+
+
+static void
+reactor_run_event_loop(struct lcb_io_opt_st *iops)
+{
+    PyObject *result;
+    PyGILState_STATE gstate;
+
+    gstate = PyGILState_Ensure();
+    result = reactor_call(iops, "run", "()");
+    Py_XDECREF(result);
+    PyGILState_Release(gstate);
+}
+
+
+static void
+reactor_stop_event_loop(struct lcb_io_opt_st *iops)
+{
+    PyObject *result;
+    PyGILState_STATE gstate;
+
+    gstate = PyGILState_Ensure();
+    result = reactor_call(iops, "stop", "()");
+    Py_XDECREF(result);
+    PyGILState_Release(gstate);
+}
+
+
+static lcb_socket_t
+reactor_socket(struct lcb_io_opt_st *iops, int domain, int type, int protocol)
+{
+    lcb_socket_t sock;
+    int flags;
+
+    sock = socket(domain, type, protocol);
+    if (sock == -1) {
+        iops->v.v0.error = errno;
+        return -1;
+    }
+
+    flags = fcntl(sock, F_GETFL);
+    if (flags == -1 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) == -1) {
+        iops->v.v0.error = errno;
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+
+static int
+reactor_connect(struct lcb_io_opt_st *iops, lcb_socket_t sock,
+                const struct sockaddr *name, unsigned int namelen)
+{
+    int rc = connect(sock, name, (socklen_t) namelen);
+    if (rc == -1) {
+        iops->v.v0.error = errno;
+    }
+    return rc;
+}
+
+
+static lcb_ssize_t
+reactor_recv(struct lcb_io_opt_st *iops, lcb_socket_t sock,
+             void *buffer, lcb_size_t len, int flags)
+{
+    lcb_ssize_t rc = recv(sock, buffer, len, flags);
+    if (rc < 0) {
+        iops->v.v0.error = errno;
+    }
+    return rc;
+}
+
+
+static lcb_ssize_t
+reactor_send(struct lcb_io_opt_st *iops, lcb_socket_t sock,
+             const void *msg, lcb_size_t len, int flags)
+{
+    lcb_ssize_t rc = send(sock, msg, len, flags);
+    if (rc < 0) {
+        iops->v.v0.error = errno;
+    }
+    return rc;
+}
+
+
+#define REACTOR_MAX_IOV 8
+
+static lcb_size_t
+reactor_iov(struct iovec *vec, struct lcb_iovec_st *iov, lcb_size_t niov)
+{
+    lcb_size_t i;
+
+    if (niov > REACTOR_MAX_IOV) {
+        niov = REACTOR_MAX_IOV;
+    }
+    for (i = 0; i < niov; i++) {
+        vec[i].iov_base = iov[i].iov_base;
+        vec[i].iov_len = iov[i].iov_len;
+    }
+    return niov;
+}
+
+
+static lcb_ssize_t
+reactor_recvv(struct lcb_io_opt_st *iops, lcb_socket_t sock,
+              struct lcb_iovec_st *iov, lcb_size_t niov)
+{
+    struct iovec vec[REACTOR_MAX_IOV];
+    lcb_ssize_t rc;
+
+    rc = readv(sock, vec, reactor_iov(vec, iov, niov));
+    if (rc < 0) {
+        iops->v.v0.error = errno;
+    }
+    return rc;
+}
+
+
+static lcb_ssize_t
+reactor_sendv(struct lcb_io_opt_st *iops, lcb_socket_t sock,
+              struct lcb_iovec_st *iov, lcb_size_t niov)
+{
+    struct iovec vec[REACTOR_MAX_IOV];
+    lcb_ssize_t rc;
+
+    rc = writev(sock, vec, reactor_iov(vec, iov, niov));
+    if (rc < 0) {
+        iops->v.v0.error = errno;
+    }
+    return rc;
+}
+
+
+static void
+reactor_close(struct lcb_io_opt_st *iops, lcb_socket_t sock)
+{
+    close(sock);
+}
+
+
+static void
+io_ops_destructor(PyObject *capsule)
+{
+    struct lcb_io_opt_st *iops;
+
+    iops = PyCapsule_GetPointer(capsule, "io_ops");
+    Py_DECREF((PyObject *) iops->v.v0.cookie);
+    free(iops);
+}
+
+
+static PyObject *
+pylcb_create_io_ops(PyObject *self, PyObject *args) {
+    PyObject *reactor;
+    struct lcb_io_opt_st *iops;
+
+    if (!PyArg_ParseTuple(args, "O", &reactor)) {
+        return NULL;
+    }
+
+    iops = calloc(1, sizeof(struct lcb_io_opt_st));
+    if (!iops) {
+        PyErr_SetString(PyExc_MemoryError,
+                        "ran out of memory while allocating io ops");
+        return NULL;
+    }
+
+    /* the capsule owns the io ops, libcouchbase must not free them */
+    iops->version = 0;
+    iops->v.v0.cookie = reactor;
+    iops->v.v0.need_cleanup = 0;
+    iops->v.v0.socket = reactor_socket;
+    iops->v.v0.connect = reactor_connect;
+    iops->v.v0.recv = reactor_recv;
+    iops->v.v0.send = reactor_send;
+    iops->v.v0.recvv = reactor_recvv;
+    iops->v.v0.sendv = reactor_sendv;
+    iops->v.v0.close = reactor_close;
+    iops->v.v0.create_event = reactor_create_event;
+    iops->v.v0.destroy_event = reactor_destroy_event;
+    iops->v.v0.update_event = reactor_update_event;
+    iops->v.v0.delete_event = reactor_delete_event;
+    iops->v.v0.create_timer = reactor_create_event;
+    iops->v.v0.destroy_timer = reactor_destroy_event;
+    iops->v.v0.update_timer = reactor_update_timer;
+    iops->v.v0.delete_timer = reactor_delete_timer;
+    iops->v.v0.run_event_loop = reactor_run_event_loop;
+    iops->v.v0.stop_event_loop = reactor_stop_event_loop;
+    Py_INCREF(reactor);
+
+    return PyCapsule_New(iops, "io_ops", io_ops_destructor);
+}
 
 
 /* ----------------------------------------------------------
     Each instance has its own unique set of python callbacks.
-    Implemented as a simple linked list with linear search.
+    The node is stored as the libcouchbase instance cookie, so
+    callbacks find it in O(1) with lcb_get_cookie.
    ---------------------------------------------------------- */
 struct instance_callbacks {
     PyObject *arithmetic_callback;
@@ -65,128 +551,1681 @@ struct instance_callbacks {
     PyObject *version_callback;
 };
 
+/* zlib compression of stored values, off while threshold is 0 */
+struct compression {
+    lcb_size_t threshold;   /* compress values of at least this size */
+    int level;
+    unsigned long compressed;   /* values stored compressed */
+    unsigned long skipped;      /* values that did not get smaller */
+    unsigned long decompressed;
+    unsigned PY_LONG_LONG bytesIn;  /* sizes before and after compression */
+    unsigned PY_LONG_LONG bytesOut;
+};
+
+/* near caches of recently read values and of keys known to be missing,
+   off while capacity is 0 */
+struct near_entry {
+    char *key;          /* the key, followed by the value once filled */
+    lcb_size_t nkey;
+    char *bytes;        /* raw value as stored */
+    lcb_size_t nbytes;
+    lcb_uint32_t flags;
+    lcb_cas_t cas;
+    double expiry;      /* 0 until filled */
+    const void *filler; /* cookie of the get allowed to fill the entry */
+    int referenced;     /* CLOCK bit, set by hits */
+    int next;           /* next entry of the hash chain, -1 ends it */
+};
+
+struct near_cache {
+    lcb_error_t keeps;      /* the get result cached, a value or ENOENT */
+    lcb_size_t capacity;
+    double ttl;             /* seconds an entry may be served */
+    unsigned long sampleEvery;  /* send every nth hit to the server */
+    struct near_entry *entries;
+    int *buckets;           /* first entry of each hash chain */
+    lcb_size_t nbuckets;    /* a power of two */
+    lcb_size_t hand;        /* CLOCK hand */
+    lcb_size_t size;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long expirations;
+    unsigned long invalidations;
+    unsigned long sampled;      /* hits checked against the server */
+    unsigned long stale;        /* sampled hits the server disagreed with */
+};
+
 struct callbacks_node {
     lcb_t instance;
     struct instance_callbacks callbacks;
-    struct callbacks_node *prev;
-    struct callbacks_node *next;
+    PyObject *io;   /* event_base or io_ops capsule the instance runs on */
+    int connected;  /* a configuration or an error ended the connect */
+    PyObject *transcoder;   /* encodes and decodes values, NULL for native */
+    struct compression compression;
+    struct near_cache nearCache;
+    struct near_cache missCache;
 };
 
-static struct callbacks_node *callbacksRoot = NULL;
+static void near_cache_free(struct near_cache *cache);
+
+
+static struct callbacks_node *
+add_callbacks_node(lcb_t instance)
+{
+    struct callbacks_node *newNode = calloc(1, sizeof(struct callbacks_node));
+    if (!newNode) {
+        PyErr_SetString(PyExc_MemoryError,
+                        "ran out of memory while allocating callbacks_node");
+        return NULL;
+    }
+    newNode->instance = instance;
+    newNode->nearCache.keeps = LCB_SUCCESS;
+    newNode->missCache.keeps = LCB_KEY_ENOENT;
+    lcb_set_cookie(instance, newNode);
+    return newNode;
+}
+
+
+static struct callbacks_node *
+find_callbacks_node(lcb_t instance)
+{
+    return (struct callbacks_node *) lcb_get_cookie(instance);
+}
 
 
 static void
-print_callbacks_node_list()
+remove_callbacks_node(lcb_t instance)
 {
     struct callbacks_node *node;
 
-    node = callbacksRoot;
-    while (node) {
-        node = node->next;
+    node = find_callbacks_node(instance);
+    if (node) {
+        lcb_set_cookie(instance, NULL);
+
+        Py_XDECREF(node->callbacks.arithmetic_callback);
+        Py_XDECREF(node->callbacks.configuration_callback);
+        Py_XDECREF(node->callbacks.error_callback);
+        Py_XDECREF(node->callbacks.flush_callback);
+        Py_XDECREF(node->callbacks.get_callback);
+        Py_XDECREF(node->callbacks.http_complete_callback);
+        Py_XDECREF(node->callbacks.http_data_callback);
+        Py_XDECREF(node->callbacks.observe_callback);
+        Py_XDECREF(node->callbacks.remove_callback);
+        Py_XDECREF(node->callbacks.stat_callback);
+        Py_XDECREF(node->callbacks.store_callback);
+        Py_XDECREF(node->callbacks.touch_callback);
+        Py_XDECREF(node->callbacks.unlock_callback);
+        Py_XDECREF(node->callbacks.verbosity_callback);
+        Py_XDECREF(node->callbacks.version_callback);
+        Py_XDECREF(node->transcoder);
+        near_cache_free(&node->nearCache);
+        near_cache_free(&node->missCache);
+
+        free(node);
+    }
+}
+
+
+static PyObject *
+set_callback(PyObject *callback, PyObject **target)
+{
+    if (!PyCallable_Check(callback)) {
+        PyErr_SetString(PyExc_TypeError, "parameter must be callable");
+        return NULL;
+    }
+
+    Py_XINCREF(callback);   /* Add a reference to new callback */
+    Py_XDECREF(*target);    /* Dispose of previous callback */
+    *target = callback;     /* Remember new callback */
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+/* The libcouchbase callbacks below are invoked from inside lcb_wait with
+   the GIL released, so each one takes it back with PyGILState_Ensure
+   before touching the callbacks node or any Python object. */
+static void
+do_callback(PyObject *callback, PyObject *arglist)
+{
+    PyObject *result;
+
+    if (!arglist)
+        return;
+
+    result = PyObject_CallObject(callback, arglist);
+    Py_DECREF(arglist);
+    if (result)
+        Py_DECREF(result);
+    else
+        PyErr_WriteUnraisable(callback);
+}
+
+
+/* ----------------------------------------------------------
+    Native result collection.
+
+    Operations store their responses straight into the cookie
+    they were scheduled with: a dict collects results by key,
+    a list collects them in arrival order.  No python code runs
+    per response unless a python callback was set for the
+    operation, which is then called as well, or the cookie is
+    itself callable (the async API resolving a future), which
+    is called with the result.
+
+    Every scheduled command holds a reference to its cookie
+    until the callback for it has run.
+   ---------------------------------------------------------- */
+#ifndef PyStructSequence_GET_ITEM
+#define PyStructSequence_GET_ITEM(op, i) (((PyStructSequence *)(op))->ob_item[i])
+#endif
+
+static PyTypeObject ResultType;
+static PyTypeObject HttpResultType;
+static PyTypeObject ServerResultType;
+static PyTypeObject ObserveResultType;
+
+static PyStructSequence_Field result_fields[] = {
+    { "error", "libcouchbase error code" },
+    { "key", "key the response is for" },
+    { "value", "value for get and arithmetic, otherwise None" },
+    { "flags", "item flags" },
+    { "cas", "item CAS" },
+    { NULL }
+};
+
+static PyStructSequence_Desc result_desc = {
+    "pylcb.Result",
+    "Result of a key based operation",
+    result_fields,
+    5
+};
+
+static PyStructSequence_Field http_result_fields[] = {
+    { "error", "libcouchbase error code" },
+    { "status", "HTTP status code" },
+    { "path", "request path" },
+    { "value", "response body" },
+    { NULL }
+};
+
+static PyStructSequence_Desc http_result_desc = {
+    "pylcb.HttpResult",
+    "Result of an HTTP request",
+    http_result_fields,
+    4
+};
+
+static PyStructSequence_Field server_result_fields[] = {
+    { "error", "libcouchbase error code" },
+    { "server", "server endpoint the response came from" },
+    { "key", "stat name, None for flush" },
+    { "value", "stat value, None for flush" },
+    { NULL }
+};
+
+static PyStructSequence_Desc server_result_desc = {
+    "pylcb.ServerResult",
+    "Per server result of stats and flush",
+    server_result_fields,
+    4
+};
+
+
+static PyStructSequence_Field observe_result_fields[] = {
+    { "error", "libcouchbase error code" },
+    { "key", "key the response is for" },
+    { "status", "LCB_OBSERVE_* state of the key on the server" },
+    { "from_master", "true when the server is the key's master" },
+    { "cas", "item CAS on the server" },
+    { NULL }
+};
+
+static PyStructSequence_Desc observe_result_desc = {
+    "pylcb.ObserveResult",
+    "Per server state of a key reported by observe",
+    observe_result_fields,
+    5
+};
+
+
+/* build a value object, None when the response carries no bytes */
+static PyObject *
+new_bytes(const void *bytes, lcb_size_t nbytes)
+{
+    if (!bytes) {
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+    return PyString_FromStringAndSize(bytes, nbytes);
+}
+
+
+/* copy a value into a bytearray, growing it when it is too small, and
+   return the number of bytes copied.  No view of the bytearray is handed
+   out, so it can still grow on the next call.  Returns NULL with the
+   exception set when it can not be resized */
+static PyObject *
+copy_into_buffer(PyObject *buffer, const void *bytes, lcb_size_t nbytes)
+{
+    if (!bytes) {
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+    if (!PyByteArray_Check(buffer)) {
+        PyErr_SetString(PyExc_TypeError, "buffer must be a bytearray");
+        return NULL;
+    }
+    if ((lcb_size_t) PyByteArray_GET_SIZE(buffer) < nbytes &&
+        PyByteArray_Resize(buffer, nbytes) < 0) {
+        return NULL;
+    }
+    memcpy(PyByteArray_AS_STRING(buffer), bytes, nbytes);
+    return PyInt_FromSsize_t(nbytes);
+}
+
+
+/* value is a new reference that is stolen */
+static PyObject *
+new_result(lcb_error_t error, const void *key, lcb_size_t nkey,
+           PyObject *value, lcb_uint32_t flags, lcb_cas_t cas)
+{
+    PyObject *result;
+
+    if (!value) {
+        return NULL;
+    }
+    result = PyStructSequence_New(&ResultType);
+    if (!result) {
+        Py_DECREF(value);
+        return NULL;
+    }
+    PyStructSequence_SET_ITEM(result, 0, PyInt_FromLong(error));
+    PyStructSequence_SET_ITEM(result, 1, new_bytes(key, nkey));
+    PyStructSequence_SET_ITEM(result, 2, value);
+    PyStructSequence_SET_ITEM(result, 3, PyLong_FromUnsignedLong(flags));
+    PyStructSequence_SET_ITEM(result, 4, PyLong_FromUnsignedLongLong(cas));
+    return result;
+}
+
+
+static PyObject *
+new_http_result(lcb_error_t error, const lcb_http_resp_t *resp)
+{
+    PyObject *result;
+
+    result = PyStructSequence_New(&HttpResultType);
+    if (!result) {
+        return NULL;
+    }
+    PyStructSequence_SET_ITEM(result, 0, PyInt_FromLong(error));
+    PyStructSequence_SET_ITEM(result, 1, PyInt_FromLong(resp->v.v0.status));
+    PyStructSequence_SET_ITEM(result, 2,
+                              new_bytes(resp->v.v0.path, resp->v.v0.npath));
+    PyStructSequence_SET_ITEM(result, 3,
+                              new_bytes(resp->v.v0.bytes, resp->v.v0.nbytes));
+    return result;
+}
+
+
+static PyObject *
+new_server_result(lcb_error_t error, const char *server,
+                  const void *key, lcb_size_t nkey,
+                  const void *bytes, lcb_size_t nbytes)
+{
+    PyObject *result;
+
+    result = PyStructSequence_New(&ServerResultType);
+    if (!result) {
+        return NULL;
+    }
+    PyStructSequence_SET_ITEM(result, 0, PyInt_FromLong(error));
+    PyStructSequence_SET_ITEM(result, 1, PyString_FromString(server));
+    PyStructSequence_SET_ITEM(result, 2, new_bytes(key, nkey));
+    PyStructSequence_SET_ITEM(result, 3, new_bytes(bytes, nbytes));
+    return result;
+}
+
+
+static PyObject *
+new_observe_result(lcb_error_t error, const lcb_observe_resp_t *resp)
+{
+    PyObject *result;
+
+    result = PyStructSequence_New(&ObserveResultType);
+    if (!result) {
+        return NULL;
+    }
+    PyStructSequence_SET_ITEM(result, 0, PyInt_FromLong(error));
+    PyStructSequence_SET_ITEM(result, 1,
+                              new_bytes(resp->v.v0.key, resp->v.v0.nkey));
+    PyStructSequence_SET_ITEM(result, 2, PyInt_FromLong(resp->v.v0.status));
+    PyStructSequence_SET_ITEM(result, 3,
+                              PyBool_FromLong(resp->v.v0.from_master));
+    PyStructSequence_SET_ITEM(result, 4,
+                              PyLong_FromUnsignedLongLong(resp->v.v0.cas));
+    return result;
+}
+
+
+static void
+hold_cookie(PyObject *cookie, Py_ssize_t ncommands)
+{
+    while (ncommands-- > 0) {
+        Py_INCREF(cookie);
+    }
+}
+
+
+static void
+release_cookie(PyObject *cookie, Py_ssize_t ncommands)
+{
+    while (ncommands-- > 0) {
+        Py_DECREF(cookie);
+    }
+}
+
+
+/* store result in cookie.  result is a new reference that is stolen */
+static void
+deliver_result(const void *cookie, PyObject *result)
+{
+    PyObject *target = (PyObject *) cookie;
+    PyObject *called;
+    int rc = 0;
+
+    if (!result) {
+        PyErr_WriteUnraisable(target);
+        return;
+    }
+
+    if (PyDict_Check(target)) {
+        rc = PyDict_SetItem(target, PyStructSequence_GET_ITEM(result, 1),
+                            result);
+    } else if (PyList_Check(target)) {
+        rc = PyList_Append(target, result);
+    } else if (PyCallable_Check(target)) {
+        called = PyObject_CallFunctionObjArgs(target, result, NULL);
+        if (called) {
+            Py_DECREF(called);
+        } else {
+            rc = -1;
+        }
+    }
+    if (rc < 0) {
+        PyErr_WriteUnraisable(target);
+    }
+
+    Py_DECREF(result);
+}
+
+
+/* ---------------------------------------------------
+    Transcoding.
+
+    Stored values are encoded by type, and the format is
+    recorded in the top byte of the item flags so get
+    can decode them without guessing.  Items without a
+    format byte, such as counters or values written by
+    older clients, keep the legacy decoding.  A Python
+    transcoder set on an instance replaces the native
+    one.
+   ---------------------------------------------------*/
+
+#define FMT_MASK    0xff000000
+#define FMT_LEGACY  0x00000000
+#define FMT_PICKLE  0x01000000
+#define FMT_JSON    0x02000000
+#define FMT_BYTES   0x03000000
+#define FMT_UTF8    0x04000000
+#define FMT_ZLIB    0x80000000  /* set on top of the format */
+
+static PyObject *json_dumps;
+static PyObject *json_dumps_kwargs;
+static PyObject *json_loads;
+static PyObject *pickle_dumps;
+static PyObject *pickle_loads;
+
+
+static int
+is_integer(const char *bytes, lcb_size_t nbytes, int allowSign)
+{
+    lcb_size_t ii = 0;
+
+    if (allowSign && nbytes > 1 && bytes[0] == '-') {
+        ii = 1;
+    }
+    if (nbytes == 0 || nbytes > 64) {
+        return 0;
+    }
+    for (; ii < nbytes; ii++) {
+        if (bytes[ii] < '0' || bytes[ii] > '9') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+static PyObject *
+new_integer(const char *bytes, lcb_size_t nbytes)
+{
+    char digits[66];
+
+    memcpy(digits, bytes, nbytes);
+    digits[nbytes] = '\0';
+    return PyInt_FromString(digits, NULL, 10);
+}
+
+
+/* encode value with the native transcoder.  Returns a new reference to
+   a buffer object and sets *format */
+static PyObject *
+native_encode(PyObject *value, lcb_uint32_t *format)
+{
+    PyObject *args;
+    PyObject *encoded;
+
+    if (PyBool_Check(value)) {
+        *format = FMT_JSON;
+        return PyString_FromString(value == Py_True ? "true" : "false");
+    }
+    if (PyInt_Check(value) || PyLong_Check(value)) {
+        *format = FMT_JSON;
+        return PyObject_Str(value);
+    }
+    if (value == Py_None) {
+        *format = FMT_JSON;
+        return PyString_FromString("null");
+    }
+    if (PyUnicode_Check(value)) {
+        *format = FMT_UTF8;
+        return PyUnicode_AsUTF8String(value);
+    }
+    if (PyObject_CheckBuffer(value)) {
+        *format = FMT_BYTES;
+        Py_INCREF(value);
+        return value;
+    }
+    if (PyDict_Check(value) || PyList_Check(value) ||
+        PyTuple_Check(value) || PyFloat_Check(value)) {
+        *format = FMT_JSON;
+        args = PyTuple_Pack(1, value);
+        if (!args) {
+            return NULL;
+        }
+        encoded = PyObject_Call(json_dumps, args, json_dumps_kwargs);
+        Py_DECREF(args);
+        return encoded;
+    }
+
+    *format = FMT_PICKLE;
+    return PyObject_CallFunction(pickle_dumps, "Oi", value, 2);
+}
+
+
+static PyObject *
+native_decode(const char *bytes, lcb_size_t nbytes, lcb_uint32_t flags)
+{
+    PyObject *raw;
+    PyObject *value;
+
+    switch (flags & FMT_MASK) {
+    case FMT_BYTES:
+        return PyString_FromStringAndSize(bytes, nbytes);
+
+    case FMT_UTF8:
+        return PyUnicode_DecodeUTF8(bytes, nbytes, "strict");
+
+    case FMT_JSON:
+        if (is_integer(bytes, nbytes, 1)) {
+            return new_integer(bytes, nbytes);
+        }
+        /* the literals native_encode writes for booleans and None */
+        if (nbytes == 4 && memcmp(bytes, "true", 4) == 0) {
+            Py_INCREF(Py_True);
+            return Py_True;
+        }
+        if (nbytes == 5 && memcmp(bytes, "false", 5) == 0) {
+            Py_INCREF(Py_False);
+            return Py_False;
+        }
+        if (nbytes == 4 && memcmp(bytes, "null", 4) == 0) {
+            Py_INCREF(Py_None);
+            return Py_None;
+        }
+        raw = PyString_FromStringAndSize(bytes, nbytes);
+        if (!raw) {
+            return NULL;
+        }
+        value = PyObject_CallFunctionObjArgs(json_loads, raw, NULL);
+        Py_DECREF(raw);
+        return value;
+
+    case FMT_PICKLE:
+        raw = PyString_FromStringAndSize(bytes, nbytes);
+        if (!raw) {
+            return NULL;
+        }
+        value = PyObject_CallFunctionObjArgs(pickle_loads, raw, NULL);
+        Py_DECREF(raw);
+        return value;
+
+    default:
+        /* for compatibility with old couchbase python client, do an
+           integer conversion to strings made up only of numeric digits */
+        if (is_integer(bytes, nbytes, 0)) {
+            return new_integer(bytes, nbytes);
+        }
+        return PyString_FromStringAndSize(bytes, nbytes);
+    }
+}
+
+
+/* compress value when the instance compresses values of its size and it
+   gets smaller.  Returns 1 with the bytes to store in *compressed, which
+   the caller frees, 0 when the value is stored as it is, or -1.  Appends
+   and prepends are refused, since the item may be stored compressed and
+   the joined bytes would no longer inflate */
+static int
+compress_value(struct callbacks_node *node, lcb_storage_t operation,
+               const Py_buffer *value, lcb_uint32_t *flags,
+               char **compressed, lcb_size_t *ncompressed)
+{
+    struct compression *compression;
+    uLongf size;
+    int rc;
+
+    *compressed = NULL;
+    if (!node || !node->compression.threshold) {
+        return 0;
+    }
+    compression = &node->compression;
+    if (operation == LCB_APPEND || operation == LCB_PREPEND) {
+        PyErr_SetString(PyExc_ValueError, "append and prepend can not be "
+                        "used while values are stored compressed");
+        return -1;
+    }
+    if ((lcb_size_t) value->len < compression->threshold) {
+        return 0;
+    }
+
+    size = compressBound(value->len);
+    *compressed = malloc(size);
+    if (!*compressed) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    rc = compress2((Bytef *) *compressed, &size, value->buf, value->len,
+                   compression->level);
+    Py_END_ALLOW_THREADS
+
+    if (rc != Z_OK || size >= (uLongf) value->len) {
+        free(*compressed);
+        *compressed = NULL;
+        compression->skipped++;
+        return 0;
+    }
+
+    compression->compressed++;
+    compression->bytesIn += value->len;
+    compression->bytesOut += size;
+    *ncompressed = size;
+    *flags |= FMT_ZLIB;
+    return 1;
+}
+
+
+/* inflate a value stored with FMT_ZLIB into a buffer the caller frees */
+static int
+decompress_value(struct callbacks_node *node, const void *bytes,
+                 lcb_size_t nbytes, char **inflated, lcb_size_t *ninflated)
+{
+    uLongf size = nbytes * 4 + 64;
+    char *buffer;
+    int rc;
+
+    while (1) {
+        buffer = malloc(size);
+        if (!buffer) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        *ninflated = size;
+        rc = uncompress((Bytef *) buffer, &size, bytes, nbytes);
+        if (rc != Z_BUF_ERROR) {
+            break;
+        }
+        free(buffer);
+        size = *ninflated * 2;
+    }
+    if (rc != Z_OK) {
+        free(buffer);
+        PyErr_Format(PyExc_IOError, "pylcb, failed to decompress value: %s",
+                     zError(rc));
+        return -1;
+    }
+
+    if (node) {
+        node->compression.decompressed++;
+    }
+    *inflated = buffer;
+    *ninflated = size;
+    return 0;
+}
+
+
+/* encode value for storing into buffer, which holds the encoded object
+   until it is released.  The format replaces the top byte of *flags */
+static int
+encode_value(struct callbacks_node *node, PyObject *value,
+             lcb_uint32_t *flags, Py_buffer *buffer)
+{
+    PyObject *encoded;
+    unsigned long encodedFlags;
+    lcb_uint32_t format;
+    int rc;
+
+    if (node && node->transcoder) {
+        encoded = PyObject_CallMethod(node->transcoder, "encode", "Ok",
+                                      value, (unsigned long) *flags);
+        if (!encoded) {
+            return -1;
+        }
+        if (!PyArg_ParseTuple(encoded, "Ok;encode must return "
+                              "(bytes, flags)", &value, &encodedFlags)) {
+            Py_DECREF(encoded);
+            return -1;
+        }
+        *flags = (lcb_uint32_t) encodedFlags;
+        rc = PyObject_GetBuffer(value, buffer, PyBUF_SIMPLE);
+        Py_DECREF(encoded);
+        return rc;
+    }
+
+    encoded = native_encode(value, &format);
+    if (!encoded) {
+        return -1;
+    }
+    *flags = (*flags & ~FMT_MASK) | format;
+    rc = PyObject_GetBuffer(encoded, buffer, PyBUF_SIMPLE);
+    Py_DECREF(encoded);
+    return rc;
+}
+
+
+/* decode a value from a get response.  Returns NULL with the exception
+   set when it fails to inflate or to decode */
+static PyObject *
+decode_value(struct callbacks_node *node, const void *bytes,
+             lcb_size_t nbytes, lcb_uint32_t flags)
+{
+    PyObject *value;
+    char *inflated = NULL;
+    lcb_size_t ninflated;
+
+    if (!bytes) {
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+    if (flags & FMT_ZLIB) {
+        if (decompress_value(node, bytes, nbytes, &inflated, &ninflated) < 0) {
+            return NULL;
+        }
+        bytes = inflated;
+        nbytes = ninflated;
+        flags &= ~FMT_ZLIB;
+    }
+    if (node && node->transcoder) {
+        value = PyObject_CallMethod(node->transcoder, "decode", "s#k",
+                                    bytes, (Py_ssize_t) nbytes,
+                                    (unsigned long) flags);
+    } else {
+        value = native_decode(bytes, nbytes, flags);
+    }
+    free(inflated);
+    return value;
+}
+
+
+static PyObject *
+pylcb_encode_value(PyObject *self, PyObject *args)
+{
+    PyObject *value;
+    PyObject *encoded;
+    unsigned long flags = 0;
+    lcb_uint32_t format;
+
+    if (!PyArg_ParseTuple(args, "O|k", &value, &flags)) {
+        return NULL;
+    }
+    encoded = native_encode(value, &format);
+    if (!encoded) {
+        return NULL;
+    }
+    flags = (flags & ~FMT_MASK) | format;
+    return Py_BuildValue("Nk", encoded, flags);
+}
+
+
+static PyObject *
+pylcb_decode_value(PyObject *self, PyObject *args)
+{
+    const char *bytes;
+    Py_ssize_t nbytes;
+    unsigned long flags;
+
+    if (!PyArg_ParseTuple(args, "s#k", &bytes, &nbytes, &flags)) {
+        return NULL;
+    }
+    return native_decode(bytes, nbytes, flags);
+}
+
+
+static PyObject *
+pylcb_set_transcoder(PyObject *self, PyObject *args)
+{
+    PyObject *capsule;
+    PyObject *transcoder;
+    lcb_t *instancePtr;
+    struct callbacks_node *node;
+
+    if (!PyArg_ParseTuple(args, "OO", &capsule, &transcoder)) {
+        return NULL;
+    }
+    instancePtr = PyCapsule_GetPointer(capsule, "lcb_instance");
+
+    node = find_callbacks_node(*instancePtr);
+    if (!node) {
+        return NULL;
+    }
+
+    /* None goes back to the native transcoder */
+    if (transcoder == Py_None) {
+        transcoder = NULL;
+    }
+    Py_XINCREF(transcoder);
+    Py_XDECREF(node->transcoder);
+    node->transcoder = transcoder;
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static PyObject *
+pylcb_set_compression(PyObject *self, PyObject *args)
+{
+    PyObject *capsule;
+    Py_ssize_t threshold;
+    int level = Z_BEST_SPEED;
+    lcb_t *instancePtr;
+    struct callbacks_node *node;
+
+    if (!PyArg_ParseTuple(args, "On|i", &capsule, &threshold, &level)) {
+        return NULL;
+    }
+    if (level < Z_DEFAULT_COMPRESSION || level > Z_BEST_COMPRESSION) {
+        PyErr_Format(PyExc_ValueError, "compression level must be between "
+                     "%d and %d", Z_DEFAULT_COMPRESSION, Z_BEST_COMPRESSION);
+        return NULL;
+    }
+    instancePtr = PyCapsule_GetPointer(capsule, "lcb_instance");
+
+    node = find_callbacks_node(*instancePtr);
+    if (!node) {
+        return NULL;
+    }
+    node->compression.threshold = threshold > 0 ? threshold : 0;
+    node->compression.level = level;
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static PyObject *
+pylcb_compression_stats(PyObject *self, PyObject *args)
+{
+    PyObject *capsule;
+    lcb_t *instancePtr;
+    struct callbacks_node *node;
+    struct compression *compression;
+
+    if (!PyArg_ParseTuple(args, "O", &capsule)) {
+        return NULL;
+    }
+    instancePtr = PyCapsule_GetPointer(capsule, "lcb_instance");
+
+    node = find_callbacks_node(*instancePtr);
+    if (!node) {
+        return NULL;
+    }
+    compression = &node->compression;
+
+    return Py_BuildValue("{s:k,s:k,s:k,s:K,s:K}",
+                         "compressed", compression->compressed,
+                         "skipped", compression->skipped,
+                         "decompressed", compression->decompressed,
+                         "bytes_in", compression->bytesIn,
+                         "bytes_out", compression->bytesOut);
+}
+
+
+static int
+init_transcoding(void)
+{
+    PyObject *module;
+    PyObject *separators;
+
+    module = PyImport_ImportModule("json");
+    if (!module) {
+        return -1;
+    }
+    json_dumps = PyObject_GetAttrString(module, "dumps");
+    json_loads = PyObject_GetAttrString(module, "loads");
+    Py_DECREF(module);
+
+    module = PyImport_ImportModule("cPickle");
+    if (!module) {
+        return -1;
+    }
+    pickle_dumps = PyObject_GetAttrString(module, "dumps");
+    pickle_loads = PyObject_GetAttrString(module, "loads");
+    Py_DECREF(module);
+
+    separators = Py_BuildValue("(ss)", ",", ":");
+    json_dumps_kwargs = PyDict_New();
+    if (!json_dumps || !json_loads || !pickle_dumps || !pickle_loads ||
+        !separators || !json_dumps_kwargs ||
+        PyDict_SetItemString(json_dumps_kwargs, "separators",
+                             separators) < 0) {
+        Py_XDECREF(separators);
+        return -1;
+    }
+    Py_DECREF(separators);
+    return 0;
+}
+
+
+/* ---------------------------------------------------
+    Near caches.
+
+    Values read by get are kept, as the raw bytes the
+    server returned, in a bounded hash table evicted
+    with the CLOCK algorithm, and served from it for
+    up to ttl seconds.  A second table of the same
+    kind keeps keys the server reported missing, so
+    repeated probes for them fail locally.
+
+    A miss leaves a placeholder that only the response
+    to that get may fill, and writes issued through
+    the instance drop the key from both tables when
+    they are sent and when they complete, so a read
+    started before a local write never repopulates a
+    table with the old state.  Hits carry the cas read
+    with the value, so a cas write based on a stale
+    hit fails on the server.
+
+    With sampleEvery set, every nth hit is sent to the
+    server anyway and its response compared with the
+    entry, which estimates how often hits are stale.
+   ---------------------------------------------------*/
+
+static double
+near_cache_now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+
+/* FNV-1a */
+static lcb_size_t
+near_cache_hash(struct near_cache *cache, const char *key, lcb_size_t nkey)
+{
+    unsigned long hash = 2166136261UL;
+
+    while (nkey-- > 0) {
+        hash ^= (unsigned char) *key++;
+        hash *= 16777619UL;
+    }
+    return hash & (cache->nbuckets - 1);
+}
+
+
+static int
+near_cache_find(struct near_cache *cache, const char *key, lcb_size_t nkey)
+{
+    int index;
+    struct near_entry *entry;
+
+    index = cache->buckets[near_cache_hash(cache, key, nkey)];
+    while (index >= 0) {
+        entry = &cache->entries[index];
+        if (entry->nkey == nkey && memcmp(entry->key, key, nkey) == 0) {
+            return index;
+        }
+        index = entry->next;
+    }
+    return -1;
+}
+
+
+static void
+near_cache_unlink(struct near_cache *cache, int index)
+{
+    struct near_entry *entry = &cache->entries[index];
+    int *link;
+
+    link = &cache->buckets[near_cache_hash(cache, entry->key, entry->nkey)];
+    while (*link != index) {
+        link = &cache->entries[*link].next;
+    }
+    *link = entry->next;
+
+    free(entry->key);
+    memset(entry, 0, sizeof(struct near_entry));
+    cache->size--;
+}
+
+
+/* a free entry, evicting the first one the hand finds unreferenced */
+static int
+near_cache_slot(struct near_cache *cache)
+{
+    struct near_entry *entry;
+    int index;
+
+    for (;;) {
+        index = cache->hand;
+        cache->hand = (cache->hand + 1) % cache->capacity;
+        entry = &cache->entries[index];
+        if (!entry->key) {
+            return index;
+        }
+        if (entry->referenced) {
+            entry->referenced = 0;
+            continue;
+        }
+        near_cache_unlink(cache, index);
+        cache->evictions++;
+        return index;
+    }
+}
+
+
+/* the entry for key, filled and fresh, or NULL after noting that the
+   get sent with cookie may fill or check it */
+static struct near_entry *
+near_cache_lookup(struct near_cache *cache, const void *cookie,
+                  const char *key, lcb_size_t nkey)
+{
+    struct near_entry *entry;
+    lcb_size_t bucket;
+    int index;
+
+    if (!cache->capacity) {
+        return NULL;
+    }
+
+    index = near_cache_find(cache, key, nkey);
+    if (index >= 0) {
+        entry = &cache->entries[index];
+        if (entry->expiry > near_cache_now()) {
+            if (cache->sampleEvery && (cache->hits + cache->sampled + 1) %
+                                      cache->sampleEvery == 0) {
+                cache->sampled++;
+                entry->filler = cookie;
+                return NULL;
+            }
+            entry->referenced = 1;
+            cache->hits++;
+            return entry;
+        }
+        if (entry->expiry) {
+            near_cache_unlink(cache, index);
+            cache->expirations++;
+            index = -1;
+        }
+    }
+    cache->misses++;
+
+    if (index < 0) {
+        index = near_cache_slot(cache);
+        entry = &cache->entries[index];
+        entry->key = malloc(nkey);
+        if (!entry->key) {
+            return NULL;
+        }
+        memcpy(entry->key, key, nkey);
+        entry->nkey = nkey;
+        bucket = near_cache_hash(cache, key, nkey);
+        entry->next = cache->buckets[bucket];
+        cache->buckets[bucket] = index;
+        cache->size++;
+    }
+    cache->entries[index].filler = cookie;
+    return NULL;
+}
+
+
+/* whether key has a filled and fresh entry, without counting or leaving
+   a placeholder */
+static int
+near_cache_peek(struct near_cache *cache, const char *key, lcb_size_t nkey)
+{
+    int index;
+
+    if (!cache->capacity) {
+        return 0;
+    }
+    index = near_cache_find(cache, key, nkey);
+    return index >= 0 && cache->entries[index].expiry > near_cache_now();
+}
+
+
+/* store the response to a get in the placeholder its lookup left, or
+   compare it with the entry when the get was a sample */
+static void
+near_cache_store(struct near_cache *cache, const void *cookie,
+                 lcb_error_t error, const lcb_get_resp_t *resp)
+{
+    struct near_entry *entry;
+    char *key;
+    int index;
+
+    if (!cache->capacity) {
+        return;
+    }
+
+    index = near_cache_find(cache, resp->v.v0.key, resp->v.v0.nkey);
+    if (index < 0 || cache->entries[index].filler != cookie) {
+        return;
+    }
+    entry = &cache->entries[index];
+    entry->filler = NULL;
+
+    if (entry->expiry) {
+        if (error != cache->keeps || entry->cas != resp->v.v0.cas) {
+            near_cache_unlink(cache, index);
+            cache->stale++;
+        }
+        return;
+    }
+
+    /* the cas of a locked item is hidden as -1 */
+    if (error != cache->keeps || resp->v.v0.cas == (lcb_cas_t) -1) {
+        near_cache_unlink(cache, index);
+        return;
+    }
+
+    key = realloc(entry->key, entry->nkey + resp->v.v0.nbytes);
+    if (!key) {
+        near_cache_unlink(cache, index);
+        return;
+    }
+    entry->key = key;
+    entry->bytes = key + entry->nkey;
+    if (resp->v.v0.nbytes) {
+        memcpy(entry->bytes, resp->v.v0.bytes, resp->v.v0.nbytes);
+    }
+    entry->nbytes = resp->v.v0.nbytes;
+    entry->flags = resp->v.v0.flags;
+    entry->cas = resp->v.v0.cas;
+    entry->expiry = near_cache_now() + cache->ttl;
+}
+
+
+static void
+near_cache_remove(struct near_cache *cache, const void *key, lcb_size_t nkey)
+{
+    int index;
+
+    if (!cache->capacity) {
+        return;
+    }
+
+    index = near_cache_find(cache, key, nkey);
+    if (index >= 0) {
+        near_cache_unlink(cache, index);
+        cache->invalidations++;
+    }
+}
+
+
+static void
+near_cache_fill(struct callbacks_node *node, const void *cookie,
+                lcb_error_t error, const lcb_get_resp_t *resp)
+{
+    if (node) {
+        near_cache_store(&node->nearCache, cookie, error, resp);
+        near_cache_store(&node->missCache, cookie, error, resp);
+    }
+}
+
+
+/* a write to key was sent or completed */
+static void
+near_cache_invalidate(struct callbacks_node *node,
+                      const void *key, lcb_size_t nkey)
+{
+    if (node) {
+        near_cache_remove(&node->nearCache, key, nkey);
+        near_cache_remove(&node->missCache, key, nkey);
+    }
+}
+
+
+static void
+near_cache_clear(struct near_cache *cache)
+{
+    lcb_size_t i;
+
+    for (i = 0; i < cache->capacity; i++) {
+        free(cache->entries[i].key);
+    }
+    memset(cache->entries, 0, cache->capacity * sizeof(struct near_entry));
+    memset(cache->buckets, -1, cache->nbuckets * sizeof(int));
+    cache->hand = 0;
+    cache->size = 0;
+}
+
+
+static void
+near_cache_free(struct near_cache *cache)
+{
+    if (cache->capacity) {
+        near_cache_clear(cache);
+    }
+    free(cache->entries);
+    free(cache->buckets);
+    cache->entries = NULL;
+    cache->buckets = NULL;
+    cache->capacity = 0;
+    cache->nbuckets = 0;
+}
+
+
+/* resizing drops every entry, the counters are kept */
+static int
+near_cache_resize(struct near_cache *cache, Py_ssize_t capacity)
+{
+    lcb_size_t nbuckets;
+
+    near_cache_free(cache);
+    if (capacity <= 0) {
+        return 0;
+    }
+
+    for (nbuckets = 1; nbuckets < (lcb_size_t) capacity * 2; nbuckets <<= 1);
+    cache->entries = calloc(capacity, sizeof(struct near_entry));
+    cache->buckets = malloc(nbuckets * sizeof(int));
+    if (!cache->entries || !cache->buckets) {
+        near_cache_free(cache);
+        PyErr_SetString(PyExc_MemoryError,
+                        "ran out of memory while allocating near cache");
+        return -1;
+    }
+    cache->capacity = capacity;
+    cache->nbuckets = nbuckets;
+    near_cache_clear(cache);
+    return 0;
+}
+
+
+static PyObject *
+near_cache_stats(struct near_cache *cache)
+{
+    return Py_BuildValue("{s:k,s:k,s:k,s:k,s:k,s:k,s:k,s:n,s:n}",
+                         "hits", cache->hits,
+                         "misses", cache->misses,
+                         "evictions", cache->evictions,
+                         "expirations", cache->expirations,
+                         "invalidations", cache->invalidations,
+                         "sampled", cache->sampled,
+                         "stale", cache->stale,
+                         "size", (Py_ssize_t) cache->size,
+                         "capacity", (Py_ssize_t) cache->capacity);
+}
+
+
+static PyObject *
+pylcb_set_near_cache(PyObject *self, PyObject *args)
+{
+    PyObject *capsule;
+    Py_ssize_t capacity;
+    double ttl = 1.0;
+    unsigned long sampleEvery = 0;
+    lcb_t *instancePtr;
+    struct callbacks_node *node;
+
+    if (!PyArg_ParseTuple(args, "On|dk", &capsule, &capacity, &ttl,
+                          &sampleEvery)) {
+        return NULL;
+    }
+    instancePtr = PyCapsule_GetPointer(capsule, "lcb_instance");
+
+    node = find_callbacks_node(*instancePtr);
+    if (!node) {
+        return NULL;
+    }
+    if (near_cache_resize(&node->nearCache, capacity) < 0) {
+        return NULL;
+    }
+    node->nearCache.ttl = ttl;
+    node->nearCache.sampleEvery = sampleEvery;
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static PyObject *
+pylcb_near_cache_stats(PyObject *self, PyObject *args)
+{
+    PyObject *capsule;
+    lcb_t *instancePtr;
+    struct callbacks_node *node;
+
+    if (!PyArg_ParseTuple(args, "O", &capsule)) {
+        return NULL;
+    }
+    instancePtr = PyCapsule_GetPointer(capsule, "lcb_instance");
+
+    node = find_callbacks_node(*instancePtr);
+    if (!node) {
+        return NULL;
+    }
+
+    return near_cache_stats(&node->nearCache);
+}
+
+
+static PyObject *
+pylcb_set_miss_cache(PyObject *self, PyObject *args)
+{
+    PyObject *capsule;
+    Py_ssize_t capacity;
+    double ttl = 0.5;
+    unsigned long sampleEvery = 100;
+    lcb_t *instancePtr;
+    struct callbacks_node *node;
+
+    if (!PyArg_ParseTuple(args, "On|dk", &capsule, &capacity, &ttl,
+                          &sampleEvery)) {
+        return NULL;
+    }
+    instancePtr = PyCapsule_GetPointer(capsule, "lcb_instance");
+
+    node = find_callbacks_node(*instancePtr);
+    if (!node) {
+        return NULL;
+    }
+    if (near_cache_resize(&node->missCache, capacity) < 0) {
+        return NULL;
+    }
+    node->missCache.ttl = ttl;
+    node->missCache.sampleEvery = sampleEvery;
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static PyObject *
+pylcb_miss_cache_stats(PyObject *self, PyObject *args)
+{
+    PyObject *capsule;
+    lcb_t *instancePtr;
+    struct callbacks_node *node;
+
+    if (!PyArg_ParseTuple(args, "O", &capsule)) {
+        return NULL;
+    }
+    instancePtr = PyCapsule_GetPointer(capsule, "lcb_instance");
+
+    node = find_callbacks_node(*instancePtr);
+    if (!node) {
+        return NULL;
+    }
+
+    return near_cache_stats(&node->missCache);
+}
+
+
+/* drop key from the near and miss caches, for writes sent elsewhere */
+static PyObject *
+pylcb_forget_cached(PyObject *self, PyObject *args)
+{
+    PyObject *capsule;
+    const char *key;
+    Py_ssize_t nkey;
+    lcb_t *instancePtr;
+
+    if (!PyArg_ParseTuple(args, "Os#", &capsule, &key, &nkey)) {
+        return NULL;
+    }
+    instancePtr = PyCapsule_GetPointer(capsule, "lcb_instance");
+
+    near_cache_invalidate(find_callbacks_node(*instancePtr), key, nkey);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+/* ---------------------------------------------------
+    Streaming view rows.
+
+    A RowStream is passed as cookie to a chunked view
+    request.  Body fragments from http_data_callback
+    are scanned as they arrive, and every element of
+    the top level "rows" array is cut out as its own
+    JSON string.  Only the row being parsed and the
+    bytes outside the rows array are kept, so memory
+    does not grow with the size of the result.
+   ---------------------------------------------------*/
+
+struct row_stream {
+    PyObject_HEAD
+    PyObject *rows;     /* complete rows not taken yet, as JSON strings */
+    char *row;          /* row being parsed */
+    size_t nrow;
+    size_t rowsize;
+    char *rest;         /* body without the contents of the rows array */
+    size_t nrest;
+    size_t restsize;
+    int depth;          /* JSON nesting depth at the scan position */
+    int in_string;
+    int escape;
+    int in_rows;
+    char key[4];        /* start of the last string at depth 1 */
+    int nkey;
+    int closed;         /* reader went away, drop rows */
+    lcb_http_request_t request; /* in flight, NULL once complete */
+    int done;
+    int error;
+    int status;
+};
+
+static PyTypeObject RowStreamType;
+
+#define ROW_BYTE 1
+#define REST_BYTE 2
+
+
+static int
+append_byte(char **buf, size_t *n, size_t *size, char c)
+{
+    char *grown;
+
+    if (*n == *size) {
+        grown = realloc(*buf, *size ? *size * 2 : 256);
+        if (!grown) {
+            return -1;
+        }
+        *buf = grown;
+        *size = *size ? *size * 2 : 256;
+    }
+    (*buf)[(*n)++] = c;
+    return 0;
+}
+
+
+static int
+row_stream_scan(struct row_stream *stream, const char *bytes, size_t nbytes)
+{
+    size_t ii;
+    char c;
+    int where;
+    int complete;
+    PyObject *row;
+
+    for (ii = 0; ii < nbytes; ii++) {
+        c = bytes[ii];
+        complete = 0;
+        if (stream->in_rows) {
+            /* separators between rows are dropped */
+            where = stream->depth > 2 ? ROW_BYTE : 0;
+        } else {
+            where = REST_BYTE;
+        }
+
+        if (stream->in_string) {
+            if (stream->escape) {
+                stream->escape = 0;
+            } else if (c == '\\') {
+                stream->escape = 1;
+            } else if (c == '"') {
+                stream->in_string = 0;
+            }
+            if (stream->in_string && stream->depth == 1 && !stream->in_rows) {
+                if (stream->nkey < 4) {
+                    stream->key[stream->nkey] = c;
+                }
+                stream->nkey++;
+            }
+        } else {
+            switch (c) {
+            case '"':
+                stream->in_string = 1;
+                if (stream->depth == 1) {
+                    stream->nkey = 0;
+                }
+                break;
+            case '[':
+                if (!stream->in_rows && stream->depth == 1 &&
+                    stream->nkey == 4 && !memcmp(stream->key, "rows", 4)) {
+                    stream->in_rows = 1;
+                }
+                stream->depth++;
+                break;
+            case '{':
+                stream->depth++;
+                if (stream->in_rows && stream->depth == 3) {
+                    stream->nrow = 0;
+                    where = ROW_BYTE;
+                }
+                break;
+            case ']':
+            case '}':
+                if (stream->in_rows && stream->depth == 2) {
+                    stream->in_rows = 0;
+                    where = REST_BYTE;
+                }
+                stream->depth--;
+                if (stream->in_rows && stream->depth == 2) {
+                    complete = 1;
+                }
+                break;
+            }
+        }
+
+        if (where == ROW_BYTE) {
+            if (append_byte(&stream->row, &stream->nrow,
+                            &stream->rowsize, c) < 0) {
+                return -1;
+            }
+        } else if (where == REST_BYTE) {
+            if (append_byte(&stream->rest, &stream->nrest,
+                            &stream->restsize, c) < 0) {
+                return -1;
+            }
+        }
+
+        if (complete && !stream->closed) {
+            row = PyString_FromStringAndSize(stream->row, stream->nrow);
+            if (!row || PyList_Append(stream->rows, row) < 0) {
+                Py_XDECREF(row);
+                return -1;
+            }
+            Py_DECREF(row);
+        }
     }
+    return 0;
 }
 
 
-static struct callbacks_node *
-add_callbacks_node(lcb_t instance)
+static void
+row_stream_feed(struct row_stream *stream, lcb_error_t error,
+                const lcb_http_resp_t *resp)
 {
-    struct callbacks_node *newNode = calloc(1, sizeof(struct callbacks_node));
-    if (!newNode) {
-        PyErr_SetString(PyExc_MemoryError,
-                        "ran out of memory while allocating callbacks_node");
-        return NULL;
+    stream->status = resp->v.v0.status;
+    if (error != LCB_SUCCESS) {
+        stream->error = error;
     }
-    newNode->instance = instance;
-
-    if (!callbacksRoot) {
-        callbacksRoot = newNode;
-    } else {
-        callbacksRoot->prev = newNode;
-        newNode->next = callbacksRoot;
-        callbacksRoot = newNode;
+    if (!resp->v.v0.bytes) {
+        return;
+    }
+    if (row_stream_scan(stream, resp->v.v0.bytes, resp->v.v0.nbytes) < 0) {
+        if (!PyErr_Occurred()) {
+            PyErr_NoMemory();
+        }
+        PyErr_WriteUnraisable((PyObject *) stream);
+        stream->error = LCB_CLIENT_ENOMEM;
     }
-    print_callbacks_node_list();
-    return newNode;
 }
 
 
-static struct callbacks_node *
-find_callbacks_node(lcb_t instance)
+static PyObject *
+row_stream_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 {
-    struct callbacks_node *node;
+    struct row_stream *stream;
 
-    node = callbacksRoot;
-    while (node) {
-        if (node->instance == instance) {
-            break;
-        }
-        node = node->next;
+    stream = (struct row_stream *) type->tp_alloc(type, 0);
+    if (!stream) {
+        return NULL;
+    }
+    stream->rows = PyList_New(0);
+    if (!stream->rows) {
+        Py_DECREF(stream);
+        return NULL;
     }
-    return node;
+    return (PyObject *) stream;
 }
 
 
 static void
-remove_callbacks_node(lcb_t instance)
+row_stream_dealloc(struct row_stream *stream)
 {
-    struct callbacks_node *node;
+    Py_XDECREF(stream->rows);
+    free(stream->row);
+    free(stream->rest);
+    Py_TYPE(stream)->tp_free((PyObject *) stream);
+}
 
-    node = find_callbacks_node(instance);
-    if (node) {
-        node->prev->next = node->next;
-        node->next->prev = node->prev;
 
-        Py_XDECREF(node->callbacks.arithmetic_callback);
-        Py_XDECREF(node->callbacks.configuration_callback);
-        Py_XDECREF(node->callbacks.error_callback);
-        Py_XDECREF(node->callbacks.flush_callback);
-        Py_XDECREF(node->callbacks.get_callback);
-        Py_XDECREF(node->callbacks.http_complete_callback);
-        Py_XDECREF(node->callbacks.http_data_callback);
-        Py_XDECREF(node->callbacks.observe_callback);
-        Py_XDECREF(node->callbacks.remove_callback);
-        Py_XDECREF(node->callbacks.stat_callback);
-        Py_XDECREF(node->callbacks.store_callback);
-        Py_XDECREF(node->callbacks.touch_callback);
-        Py_XDECREF(node->callbacks.unlock_callback);
-        Py_XDECREF(node->callbacks.verbosity_callback);
-        Py_XDECREF(node->callbacks.version_callback);
+static PyObject *
+row_stream_take_rows(struct row_stream *stream)
+{
+    PyObject *rows;
+    PyObject *empty;
 
-        free(node);
+    empty = PyList_New(0);
+    if (!empty) {
+        return NULL;
     }
+    rows = stream->rows;
+    stream->rows = empty;
+    return rows;
 }
 
 
 static PyObject *
-set_callback(PyObject *callback, PyObject **target)
+row_stream_close(struct row_stream *stream)
 {
-    if (!PyCallable_Check(callback)) {
-        PyErr_SetString(PyExc_TypeError, "parameter must be callable");
+    PyObject *rows;
+
+    stream->closed = 1;
+    rows = row_stream_take_rows(stream);
+    if (!rows) {
         return NULL;
     }
-
-    Py_XINCREF(callback);   /* Add a reference to new callback */
-    Py_XDECREF(*target);    /* Dispose of previous callback */
-    *target = callback;     /* Remember new callback */
+    Py_DECREF(rows);
 
     Py_INCREF(Py_None);
     return Py_None;
 }
 
 
-static void
-do_callback(PyObject *callback, PyObject *arglist)
+static PyObject *
+row_stream_get_rest(struct row_stream *stream, void *closure)
 {
-    PyObject *result;
+    return PyString_FromStringAndSize(stream->rest, stream->nrest);
+}
 
-    if (!arglist)
-        return;
 
-    result = PyObject_CallObject(callback, arglist);
-    Py_DECREF(arglist);
-    if (result)
-        Py_DECREF(result);
-}
+static PyMethodDef row_stream_methods[] = {
+    { "take_rows", (PyCFunction) row_stream_take_rows, METH_NOARGS,
+      "Return the rows parsed so far and forget them" },
+    { "close", (PyCFunction) row_stream_close, METH_NOARGS,
+      "Drop rows that arrive from now on" },
+    { NULL, NULL, 0, NULL }
+};
+
+static PyMemberDef row_stream_members[] = {
+    { "done", T_INT, offsetof(struct row_stream, done), READONLY,
+      "the response is complete" },
+    { "error", T_INT, offsetof(struct row_stream, error), READONLY,
+      "libcouchbase error code" },
+    { "status", T_INT, offsetof(struct row_stream, status), READONLY,
+      "HTTP status code" },
+    { NULL }
+};
+
+static PyGetSetDef row_stream_getset[] = {
+    { "rest", (getter) row_stream_get_rest, NULL,
+      "response body with the rows array emptied", NULL },
+    { NULL }
+};
+
+static PyTypeObject RowStreamType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "pylcb.RowStream",                      /* tp_name */
+    sizeof(struct row_stream),              /* tp_basicsize */
+    0,                                      /* tp_itemsize */
+    (destructor) row_stream_dealloc,        /* tp_dealloc */
+    0,                                      /* tp_print */
+    0,                                      /* tp_getattr */
+    0,                                      /* tp_setattr */
+    0,                                      /* tp_compare */
+    0,                                      /* tp_repr */
+    0,                                      /* tp_as_number */
+    0,                                      /* tp_as_sequence */
+    0,                                      /* tp_as_mapping */
+    0,                                      /* tp_hash */
+    0,                                      /* tp_call */
+    0,                                      /* tp_str */
+    0,                                      /* tp_getattro */
+    0,                                      /* tp_setattro */
+    0,                                      /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                     /* tp_flags */
+    "Cookie that parses the rows of a chunked view response",  /* tp_doc */
+    0,                                      /* tp_traverse */
+    0,                                      /* tp_clear */
+    0,                                      /* tp_richcompare */
+    0,                                      /* tp_weaklistoffset */
+    0,                                      /* tp_iter */
+    0,                                      /* tp_iternext */
+    row_stream_methods,                     /* tp_methods */
+    row_stream_members,                     /* tp_members */
+    row_stream_getset,                      /* tp_getset */
+    0,                                      /* tp_base */
+    0,                                      /* tp_dict */
+    0,                                      /* tp_descr_get */
+    0,                                      /* tp_descr_set */
+    0,                                      /* tp_dictoffset */
+    0,                                      /* tp_init */
+    0,                                      /* tp_alloc */
+    row_stream_new,                         /* tp_new */
+};
 
 
 /* ----------------------------------------
@@ -222,15 +2261,23 @@ arithmetic_callback(lcb_t instance,
 {
     PyObject *arglist;
     struct callbacks_node *node;
+    PyGILState_STATE gstate;
 
+    gstate = PyGILState_Ensure();
     node = find_callbacks_node(instance);
+    near_cache_invalidate(node, resp->v.v0.key, resp->v.v0.nkey);
     if (node) {
         if (node->callbacks.arithmetic_callback) {
             arglist = Py_BuildValue("Ois#l", cookie, error, resp->v.v0.key,
                                     resp->v.v0.nkey, resp->v.v0.value);
-            return do_callback(node->callbacks.arithmetic_callback, arglist);
+            do_callback(node->callbacks.arithmetic_callback, arglist);
         }
     }
+    deliver_result(cookie, new_result(
+        error, resp->v.v0.key, resp->v.v0.nkey,
+        PyLong_FromUnsignedLongLong(resp->v.v0.value), 0, resp->v.v0.cas));
+    release_cookie((PyObject *) cookie, 1);
+    PyGILState_Release(gstate);
 }
 
 
@@ -264,14 +2311,18 @@ configuration_callback(lcb_t instance, lcb_configuration_t config)
 {
     PyObject *arglist;
     struct callbacks_node *node;
+    PyGILState_STATE gstate;
 
+    gstate = PyGILState_Ensure();
     node = find_callbacks_node(instance);
     if (node) {
+        node->connected = 1;
         if (node->callbacks.configuration_callback) {
             arglist = Py_BuildValue("(i)", config);
-            return do_callback(node->callbacks.configuration_callback, arglist);
+            do_callback(node->callbacks.configuration_callback, arglist);
         }
     }
+    PyGILState_Release(gstate);
 }
 
 
@@ -305,22 +2356,297 @@ error_callback(lcb_t instance, lcb_error_t error, const char *errinfo)
 {
     PyObject *arglist;
     struct callbacks_node *node;
+    PyGILState_STATE gstate;
 
+    gstate = PyGILState_Ensure();
     node = find_callbacks_node(instance);
     if (node) {
+        node->connected = 1;
         if (node->callbacks.error_callback) {
             arglist = Py_BuildValue("is", error, errinfo);
             do_callback(node->callbacks.error_callback, arglist);
         }
     }
+    PyGILState_Release(gstate);
+}
+
+
+/* ----------------------------------------
+     flush_callback
+   ---------------------------------------- */
+static PyObject *
+pylcb_set_flush_callback(PyObject *self, PyObject *args)
+{
+    PyObject *capsule;
+    PyObject *callback;
+    lcb_t *instancePtr;
+    struct callbacks_node *node;
+
+    if (!PyArg_ParseTuple(args, "OO", &capsule, &callback)) {
+        return NULL;
+    }
+    instancePtr = PyCapsule_GetPointer(capsule, "lcb_instance");
+
+    node = find_callbacks_node(*instancePtr);
+    if (!node) {
+        return NULL;
+    }
+
+    return set_callback(callback, &(node->callbacks.flush_callback));
+}
+
+
+static void
+flush_callback(lcb_t instance,
+               const void *cookie,
+               lcb_error_t error,
+               lcb_server_stat_resp_t *resp)
+{
+    PyObject *arglist;
+    struct callbacks_node *node;
+    PyGILState_STATE gstate;
+
+    gstate = PyGILState_Ensure();
+    node = find_callbacks_node(instance);
+    if (node) {
+        if (node->callbacks.flush_callback) {
+            arglist = Py_BuildValue("Ois", cookie, error,
+                                    resp->v.v0.server_endpoint);
+            do_callback(node->callbacks.flush_callback, arglist);
+        }
+    }
+    /* a NULL server marks the end of the responses for this flush */
+    if (resp->v.v0.server_endpoint) {
+        deliver_result(cookie, new_server_result(
+            error, resp->v.v0.server_endpoint, NULL, 0, NULL, 0));
+    } else {
+        release_cookie((PyObject *) cookie, 1);
+    }
+    PyGILState_Release(gstate);
+}
+
+
+/* ----------------------------------------
+     get_callback
+   ---------------------------------------- */
+static PyObject *
+pylcb_set_get_callback(PyObject *self, PyObject *args)
+{
+    PyObject *capsule;
+    PyObject *callback;
+    lcb_t *instancePtr;
+    struct callbacks_node *node;
+
+    if (!PyArg_ParseTuple(args, "OO", &capsule, &callback)) {
+        return NULL;
+    }
+    instancePtr = PyCapsule_GetPointer(capsule, "lcb_instance");
+
+    node = find_callbacks_node(*instancePtr);
+    if (!node) {
+        return NULL;
+    }
+
+    return set_callback(callback, &(node->callbacks.get_callback));
+}
+             
+     
+/* hand a get result to the python callback and the cookie, both for
+   responses and for near cache hits */
+static void
+deliver_get(struct callbacks_node *node, const void *cookie,
+            lcb_error_t error, const void *key, lcb_size_t nkey,
+            const void *bytes, lcb_size_t nbytes,
+            lcb_uint32_t flags, lcb_cas_t cas)
+{
+    PyObject *arglist;
+    PyObject *target;
+    PyObject *value;
+    char *inflated;
+    lcb_size_t ninflated;
+
+    if (node) {
+        if (node->callbacks.get_callback) {
+            arglist = Py_BuildValue("Ois#s#i", cookie, error,
+                                    key, nkey, bytes, nbytes, flags);
+            do_callback(node->callbacks.get_callback, arglist);
+        }
+    }
+    /* a (target, bytearray) cookie asks for the value to be copied into
+       the caller's reusable buffer instead of a new string */
+    if (PyTuple_Check((PyObject *) cookie)) {
+        if (bytes && (flags & FMT_ZLIB)) {
+            value = NULL;
+            if (decompress_value(node, bytes, nbytes,
+                                 &inflated, &ninflated) == 0) {
+                value = copy_into_buffer(
+                    PyTuple_GET_ITEM((PyObject *) cookie, 1),
+                    inflated, ninflated);
+                free(inflated);
+            }
+        } else {
+            value = copy_into_buffer(PyTuple_GET_ITEM((PyObject *) cookie, 1),
+                                    bytes, nbytes);
+        }
+        target = PyTuple_GET_ITEM((PyObject *) cookie, 0);
+    } else {
+        value = decode_value(node, bytes, nbytes, flags);
+        target = (PyObject *) cookie;
+    }
+    if (!value) {
+        /* report why, then fail the get rather than hand back bytes that
+           are not the value, or not in the caller's buffer */
+        PyErr_WriteUnraisable(target);
+        Py_INCREF(Py_None);
+        value = Py_None;
+        error = LCB_EINVAL;
+    }
+    /* the format byte is the transcoder's, the rest is the caller's */
+    deliver_result(target, new_result(error, key, nkey, value,
+                                      flags & ~FMT_MASK, cas));
+}
+
+
+static void
+get_callback(lcb_t instance, const void *cookie,
+             lcb_error_t error, lcb_get_resp_t *resp)
+{
+    struct callbacks_node *node;
+    PyGILState_STATE gstate;
+
+    gstate = PyGILState_Ensure();
+    node = find_callbacks_node(instance);
+    near_cache_fill(node, cookie, error, resp);
+    deliver_get(node, cookie, error, resp->v.v0.key, resp->v.v0.nkey,
+                resp->v.v0.bytes, resp->v.v0.nbytes,
+                resp->v.v0.flags, resp->v.v0.cas);
+    release_cookie((PyObject *) cookie, 1);
+    PyGILState_Release(gstate);
+}
+
+
+/* ----------------------------------------
+     http_complete_callback
+   ---------------------------------------- */
+static PyObject *
+pylcb_set_http_complete_callback(PyObject *self, PyObject *args)
+{
+    PyObject *capsule;
+    PyObject *callback;
+    lcb_t *instancePtr;
+    struct callbacks_node *node;
+
+    if (!PyArg_ParseTuple(args, "OO", &capsule, &callback)) {
+        return NULL;
+    }
+    instancePtr = PyCapsule_GetPointer(capsule, "lcb_instance");
+
+    node = find_callbacks_node(*instancePtr);
+    if (!node) {
+        return NULL;
+    }
+
+    return set_callback(callback, &(node->callbacks.http_complete_callback));
+}
+
+
+static void
+http_complete_callback(lcb_http_request_t request,
+                       lcb_t instance,
+                       const void *cookie,
+                       lcb_error_t error,
+                       lcb_http_resp_t *resp)
+{
+    PyObject *arglist;
+    struct callbacks_node *node;
+    PyGILState_STATE gstate;
+
+    gstate = PyGILState_Ensure();
+    node = find_callbacks_node(instance);
+    if (node) {
+        if (node->callbacks.http_complete_callback) {
+            arglist = Py_BuildValue("Oiis#ss#", cookie, error,
+                                    resp->v.v0.status,
+                                    resp->v.v0.path, resp->v.v0.npath,
+                                    resp->v.v0.headers,
+                                    resp->v.v0.bytes, resp->v.v0.nbytes);
+            do_callback(node->callbacks.http_complete_callback, arglist);
+        }
+    }
+    if (PyObject_TypeCheck((PyObject *) cookie, &RowStreamType)) {
+        row_stream_feed((struct row_stream *) cookie, error, resp);
+        ((struct row_stream *) cookie)->request = NULL;
+        ((struct row_stream *) cookie)->done = 1;
+    } else {
+        deliver_result(cookie, new_http_result(error, resp));
+    }
+    release_cookie((PyObject *) cookie, 1);
+    PyGILState_Release(gstate);
+}
+
+
+/* ----------------------------------------
+     http_data_callback
+   ---------------------------------------- */
+static PyObject *
+pylcb_set_http_data_callback(PyObject *self, PyObject *args)
+{
+    PyObject *capsule;
+    PyObject *callback;
+    lcb_t *instancePtr;
+    struct callbacks_node *node;
+
+    if (!PyArg_ParseTuple(args, "OO", &capsule, &callback)) {
+        return NULL;
+    }
+    instancePtr = PyCapsule_GetPointer(capsule, "lcb_instance");
+
+    node = find_callbacks_node(*instancePtr);
+    if (!node) {
+        return NULL;
+    }
+
+    return set_callback(callback, &(node->callbacks.http_data_callback));
+}
+
+
+/* called with each body fragment of a chunked request.  The cookie is
+   only released by http_complete_callback, which follows the last
+   fragment */
+static void
+http_data_callback(lcb_http_request_t request,
+                   lcb_t instance,
+                   const void *cookie,
+                   lcb_error_t error,
+                   const lcb_http_resp_t *resp)
+{
+    PyObject *arglist;
+    struct callbacks_node *node;
+    PyGILState_STATE gstate;
+
+    gstate = PyGILState_Ensure();
+    node = find_callbacks_node(instance);
+    if (node) {
+        if (node->callbacks.http_data_callback) {
+            arglist = Py_BuildValue("Oiis#s#", cookie, error,
+                                    resp->v.v0.status,
+                                    resp->v.v0.path, resp->v.v0.npath,
+                                    resp->v.v0.bytes, resp->v.v0.nbytes);
+            do_callback(node->callbacks.http_data_callback, arglist);
+        }
+    }
+    if (PyObject_TypeCheck((PyObject *) cookie, &RowStreamType)) {
+        row_stream_feed((struct row_stream *) cookie, error, resp);
+    }
+    PyGILState_Release(gstate);
 }
 
 
 /* ----------------------------------------
-     flush_callback
+     observe_callback
    ---------------------------------------- */
 static PyObject *
-pylcb_set_flush_callback(PyObject *self, PyObject *args)
+pylcb_set_observe_callback(PyObject *self, PyObject *args)
 {
     PyObject *capsule;
     PyObject *callback;
@@ -337,35 +2663,47 @@ pylcb_set_flush_callback(PyObject *self, PyObject *args)
         return NULL;
     }
 
-    return set_callback(callback, &(node->callbacks.flush_callback));
+    return set_callback(callback, &(node->callbacks.observe_callback));
 }
 
 
 static void
-flush_callback(lcb_t instance,
-               const void *cookie,
-               lcb_error_t error,
-               lcb_server_stat_resp_t *resp)
+observe_callback(lcb_t instance,
+                 const void *cookie,
+                 lcb_error_t error,
+                 lcb_observe_resp_t *resp)
 {
     PyObject *arglist;
     struct callbacks_node *node;
+    PyGILState_STATE gstate;
 
+    gstate = PyGILState_Ensure();
     node = find_callbacks_node(instance);
     if (node) {
-        if (node->callbacks.flush_callback) {
-            arglist = Py_BuildValue("Ois", cookie, error,
-                                    resp->v.v0.server_endpoint);
-            return do_callback(node->callbacks.flush_callback, arglist);
+        if (node->callbacks.observe_callback && resp->v.v0.key) {
+            arglist = Py_BuildValue("Ois#ii", cookie, error,
+                                    resp->v.v0.key, resp->v.v0.nkey,
+                                    resp->v.v0.status,
+                                    resp->v.v0.from_master);
+            do_callback(node->callbacks.observe_callback, arglist);
         }
     }
+    /* every server answers for every key, and a NULL key marks the end
+       of the responses for this observe call */
+    if (resp->v.v0.key) {
+        deliver_result(cookie, new_observe_result(error, resp));
+    } else {
+        release_cookie((PyObject *) cookie, 1);
+    }
+    PyGILState_Release(gstate);
 }
 
 
 /* ----------------------------------------
-     get_callback
+     remove_callback
    ---------------------------------------- */
 static PyObject *
-pylcb_set_get_callback(PyObject *self, PyObject *args)
+pylcb_set_remove_callback(PyObject *self, PyObject *args)
 {
     PyObject *capsule;
     PyObject *callback;
@@ -382,35 +2720,43 @@ pylcb_set_get_callback(PyObject *self, PyObject *args)
         return NULL;
     }
 
-    return set_callback(callback, &(node->callbacks.get_callback));
+    return set_callback(callback, &(node->callbacks.remove_callback));
 }
-             
-     
+
+
 static void
-get_callback(lcb_t instance, const void *cookie,
-             lcb_error_t error, lcb_get_resp_t *resp)
+remove_callback(lcb_t instance,
+                const void *cookie,
+                lcb_error_t error,
+                lcb_remove_resp_t *resp)
 {
     PyObject *arglist;
     struct callbacks_node *node;
+    PyGILState_STATE gstate;
 
+    gstate = PyGILState_Ensure();
     node = find_callbacks_node(instance);
+    near_cache_invalidate(node, resp->v.v0.key, resp->v.v0.nkey);
     if (node) {
-        if (node->callbacks.get_callback) {
-            arglist = Py_BuildValue("Ois#s#i", cookie, error,
-                                    resp->v.v0.key, resp->v.v0.nkey, 
-                                    resp->v.v0.bytes, resp->v.v0.nbytes,
-                                    resp->v.v0.flags);
-            return do_callback(node->callbacks.get_callback, arglist);
+        if (node->callbacks.remove_callback) {
+            arglist = Py_BuildValue("Ois#", cookie, error,
+                                    resp->v.v0.key, resp->v.v0.nkey);
+            do_callback(node->callbacks.remove_callback, arglist);
         }
     }
+    Py_INCREF(Py_None);
+    deliver_result(cookie, new_result(
+        error, resp->v.v0.key, resp->v.v0.nkey, Py_None, 0, resp->v.v0.cas));
+    release_cookie((PyObject *) cookie, 1);
+    PyGILState_Release(gstate);
 }
 
 
 /* ----------------------------------------
-     http_complete_callback
+     stat_callback
    ---------------------------------------- */
 static PyObject *
-pylcb_set_http_complete_callback(PyObject *self, PyObject *args)
+pylcb_set_stat_callback(PyObject *self, PyObject *args)
 {
     PyObject *capsule;
     PyObject *callback;
@@ -427,39 +2773,49 @@ pylcb_set_http_complete_callback(PyObject *self, PyObject *args)
         return NULL;
     }
 
-    return set_callback(callback, &(node->callbacks.http_complete_callback));
+    return set_callback(callback, &(node->callbacks.stat_callback));
 }
 
 
 static void
-http_complete_callback(lcb_http_request_t request,
-                       lcb_t instance,
-                       const void *cookie,
-                       lcb_error_t error,
-                       lcb_http_resp_t *resp)
+stat_callback(lcb_t instance,
+              const void *cookie,
+              lcb_error_t error,
+              lcb_server_stat_resp_t *resp)
 {
     PyObject *arglist;
     struct callbacks_node *node;
+    PyGILState_STATE gstate;
 
+    gstate = PyGILState_Ensure();
     node = find_callbacks_node(instance);
     if (node) {
-        if (node->callbacks.http_complete_callback) {
-            arglist = Py_BuildValue("Oiis#ss#", cookie, error,
-                                    resp->v.v0.status,
-                                    resp->v.v0.path, resp->v.v0.npath,
-                                    resp->v.v0.headers,
+        if (node->callbacks.stat_callback) {
+            arglist = Py_BuildValue("Oiss#s#", cookie, error,
+                                    resp->v.v0.server_endpoint,
+                                    resp->v.v0.key, resp->v.v0.nkey, 
                                     resp->v.v0.bytes, resp->v.v0.nbytes);
-            return do_callback(node->callbacks.http_complete_callback, arglist);
+            do_callback(node->callbacks.stat_callback, arglist);
         }
     }
+    /* a NULL server marks the end of the responses for this stats call */
+    if (resp->v.v0.server_endpoint) {
+        deliver_result(cookie, new_server_result(
+            error, resp->v.v0.server_endpoint,
+            resp->v.v0.key, resp->v.v0.nkey,
+            resp->v.v0.bytes, resp->v.v0.nbytes));
+    } else {
+        release_cookie((PyObject *) cookie, 1);
+    }
+    PyGILState_Release(gstate);
 }
 
 
 /* ----------------------------------------
-     remove_callback
+     store_callback
    ---------------------------------------- */
 static PyObject *
-pylcb_set_remove_callback(PyObject *self, PyObject *args)
+pylcb_set_store_callback(PyObject *self, PyObject *args)
 {
     PyObject *capsule;
     PyObject *callback;
@@ -476,35 +2832,44 @@ pylcb_set_remove_callback(PyObject *self, PyObject *args)
         return NULL;
     }
 
-    return set_callback(callback, &(node->callbacks.remove_callback));
+    return set_callback(callback, &(node->callbacks.store_callback));
 }
 
 
 static void
-remove_callback(lcb_t instance,
-                const void *cookie,
-                lcb_error_t error,
-                lcb_remove_resp_t *resp)
+store_callback(lcb_t instance,
+               const void *cookie,
+               lcb_storage_t operation,
+               lcb_error_t error,
+               lcb_store_resp_t *resp)
 {
     PyObject *arglist;
     struct callbacks_node *node;
+    PyGILState_STATE gstate;
 
+    gstate = PyGILState_Ensure();
     node = find_callbacks_node(instance);
+    near_cache_invalidate(node, resp->v.v0.key, resp->v.v0.nkey);
     if (node) {
-        if (node->callbacks.remove_callback) {
-            arglist = Py_BuildValue("Ois#", cookie, error,
+        if (node->callbacks.store_callback) {
+            arglist = Py_BuildValue("Ois#", cookie, error, 
                                     resp->v.v0.key, resp->v.v0.nkey);
-            return do_callback(node->callbacks.remove_callback, arglist);
+            do_callback(node->callbacks.store_callback, arglist);
         }
     }
+    Py_INCREF(Py_None);
+    deliver_result(cookie, new_result(
+        error, resp->v.v0.key, resp->v.v0.nkey, Py_None, 0, resp->v.v0.cas));
+    release_cookie((PyObject *) cookie, 1);
+    PyGILState_Release(gstate);
 }
 
 
 /* ----------------------------------------
-     stat_callback
+     touch_callback
    ---------------------------------------- */
 static PyObject *
-pylcb_set_stat_callback(PyObject *self, PyObject *args)
+pylcb_set_touch_callback(PyObject *self, PyObject *args)
 {
     PyObject *capsule;
     PyObject *callback;
@@ -521,37 +2886,43 @@ pylcb_set_stat_callback(PyObject *self, PyObject *args)
         return NULL;
     }
 
-    return set_callback(callback, &(node->callbacks.stat_callback));
+    return set_callback(callback, &(node->callbacks.touch_callback));
 }
 
 
 static void
-stat_callback(lcb_t instance,
-              const void *cookie,
-              lcb_error_t error,
-              lcb_server_stat_resp_t *resp)
+touch_callback(lcb_t instance,
+               const void *cookie,
+               lcb_error_t error,
+               lcb_touch_resp_t *resp)
 {
     PyObject *arglist;
     struct callbacks_node *node;
+    PyGILState_STATE gstate;
 
+    gstate = PyGILState_Ensure();
     node = find_callbacks_node(instance);
+    near_cache_invalidate(node, resp->v.v0.key, resp->v.v0.nkey);
     if (node) {
-        if (node->callbacks.stat_callback) {
-            arglist = Py_BuildValue("Oiss#s#", cookie, error,
-                                    resp->v.v0.server_endpoint,
-                                    resp->v.v0.key, resp->v.v0.nkey, 
-                                    resp->v.v0.bytes, resp->v.v0.nbytes);
-            return do_callback(node->callbacks.stat_callback, arglist);
+        if (node->callbacks.touch_callback) {
+            arglist = Py_BuildValue("Ois#", cookie, error,
+                                    resp->v.v0.key, resp->v.v0.nkey);
+            do_callback(node->callbacks.touch_callback, arglist);
         }
     }
+    Py_INCREF(Py_None);
+    deliver_result(cookie, new_result(
+        error, resp->v.v0.key, resp->v.v0.nkey, Py_None, 0, resp->v.v0.cas));
+    release_cookie((PyObject *) cookie, 1);
+    PyGILState_Release(gstate);
 }
 
 
 /* ----------------------------------------
-     store_callback
+     unlock_callback
    ---------------------------------------- */
 static PyObject *
-pylcb_set_store_callback(PyObject *self, PyObject *args)
+pylcb_set_unlock_callback(PyObject *self, PyObject *args)
 {
     PyObject *capsule;
     PyObject *callback;
@@ -568,41 +2939,54 @@ pylcb_set_store_callback(PyObject *self, PyObject *args)
         return NULL;
     }
 
-    return set_callback(callback, &(node->callbacks.store_callback));
+    return set_callback(callback, &(node->callbacks.unlock_callback));
 }
 
 
 static void
-store_callback(lcb_t instance,
-               const void *cookie,
-               lcb_storage_t operation,
-               lcb_error_t error,
-               lcb_store_resp_t *resp)
+unlock_callback(lcb_t instance,
+                const void *cookie,
+                lcb_error_t error,
+                lcb_unlock_resp_t *resp)
 {
     PyObject *arglist;
     struct callbacks_node *node;
+    PyGILState_STATE gstate;
 
+    gstate = PyGILState_Ensure();
     node = find_callbacks_node(instance);
     if (node) {
-        if (node->callbacks.store_callback) {
-            arglist = Py_BuildValue("Ois#", cookie, error, 
+        if (node->callbacks.unlock_callback) {
+            arglist = Py_BuildValue("Ois#", cookie, error,
                                     resp->v.v0.key, resp->v.v0.nkey);
-            return do_callback(node->callbacks.store_callback, arglist);
+            do_callback(node->callbacks.unlock_callback, arglist);
         }
     }
+    Py_INCREF(Py_None);
+    deliver_result(cookie, new_result(
+        error, resp->v.v0.key, resp->v.v0.nkey, Py_None, 0, 0));
+    release_cookie((PyObject *) cookie, 1);
+    PyGILState_Release(gstate);
 }
 
 
 void
 lcb_instance_destructor(PyObject *capsule) {
     lcb_t *instancePtr;
+    struct callbacks_node *node;
+    PyObject *io;
 
     instancePtr = PyCapsule_GetPointer(capsule, "lcb_instance");
     fprintf(stdout, "destroying instance %p\n", *instancePtr);
+    node = find_callbacks_node(*instancePtr);
+    io = node->io;
     remove_callbacks_node(*instancePtr);
-    print_callbacks_node_list();
     lcb_destroy(*instancePtr);
     free(instancePtr);
+
+    /* the io must outlive the instance, which still uses it while it
+       is destroyed */
+    Py_XDECREF(io);
 }
 
 
@@ -616,6 +3000,7 @@ pylcb_create(PyObject *self, PyObject *args) {
     int type = LCB_TYPE_BUCKET;
 
     struct event_base *evbase;
+    struct callbacks_node *node;
     struct lcb_create_st create_options;
     struct lcb_create_io_ops_st io_opts;
 
@@ -626,19 +3011,29 @@ pylcb_create(PyObject *self, PyObject *args) {
                           &passwd, &bucket, &type))
         return NULL;
 
-    evbase = PyCapsule_GetPointer(capsule, "event_base");
-    io_opts.version = 0;
-    io_opts.v.v0.type = LCB_IO_OPS_LIBEVENT;
-    io_opts.v.v0.cookie = evbase;
-
     memset(&create_options, 0, sizeof(create_options));
     create_options.version = 1;
-    err = lcb_create_io_ops(&create_options.v.v1.io, &io_opts);
-    if (err != LCB_SUCCESS) {
-        snprintf(errMsg, 256, "pylcb, failed to create IO instance: %s\n",
-                 lcb_strerror(NULL, err));
-        PyErr_SetString(PyExc_IOError, errMsg);
-        return NULL;
+
+    /* capsule is either an io_ops from create_io_ops, or an event_base
+       from create_event_base that the libevent plugin runs on */
+    if (PyCapsule_IsValid(capsule, "io_ops")) {
+        create_options.v.v1.io = PyCapsule_GetPointer(capsule, "io_ops");
+    } else {
+        evbase = PyCapsule_GetPointer(capsule, "event_base");
+        if (!evbase) {
+            return NULL;
+        }
+        io_opts.version = 0;
+        io_opts.v.v0.type = LCB_IO_OPS_LIBEVENT;
+        io_opts.v.v0.cookie = evbase;
+
+        err = lcb_create_io_ops(&create_options.v.v1.io, &io_opts);
+        if (err != LCB_SUCCESS) {
+            snprintf(errMsg, 256, "pylcb, failed to create IO instance: %s\n",
+                     lcb_strerror(NULL, err));
+            PyErr_SetString(PyExc_IOError, errMsg);
+            return NULL;
+        }
     }
 
     create_options.v.v1.host = host;
@@ -660,9 +3055,17 @@ pylcb_create(PyObject *self, PyObject *args) {
         snprintf(errMsg, 256, "pylcb, failed to create libcouchbase instance: %s\n",
                  lcb_strerror(NULL, err));
         PyErr_SetString(PyExc_IOError, errMsg);
+        return NULL;
     }
 
-    add_callbacks_node(*instancePtr);
+    node = add_callbacks_node(*instancePtr);
+    if (!node) {
+        lcb_destroy(*instancePtr);
+        free(instancePtr);
+        return NULL;
+    }
+    Py_INCREF(capsule);
+    node->io = capsule;
 
     lcb_set_error_callback(*instancePtr, (lcb_error_callback) error_callback);
     lcb_set_arithmetic_callback(*instancePtr, (lcb_arithmetic_callback) arithmetic_callback);
@@ -670,9 +3073,13 @@ pylcb_create(PyObject *self, PyObject *args) {
     lcb_set_get_callback(*instancePtr, (lcb_get_callback) get_callback);
     lcb_set_flush_callback(*instancePtr, (lcb_flush_callback) flush_callback);
     lcb_set_http_complete_callback(*instancePtr, (lcb_http_complete_callback) http_complete_callback);
+    lcb_set_http_data_callback(*instancePtr, (lcb_http_data_callback) http_data_callback);
+    lcb_set_observe_callback(*instancePtr, (lcb_observe_callback) observe_callback);
     lcb_set_remove_callback(*instancePtr, (lcb_remove_callback) remove_callback);
     lcb_set_stat_callback(*instancePtr, (lcb_stat_callback) stat_callback);
     lcb_set_store_callback(*instancePtr, (lcb_store_callback) store_callback);
+    lcb_set_touch_callback(*instancePtr, (lcb_touch_callback) touch_callback);
+    lcb_set_unlock_callback(*instancePtr, (lcb_unlock_callback) unlock_callback);
 
     return PyCapsule_New(instancePtr, "lcb_instance", lcb_instance_destructor);
 }
@@ -690,8 +3097,12 @@ pylcb_connect(PyObject *self, PyObject *args) {
         return NULL;
     instancePtr = PyCapsule_GetPointer(capsule, "lcb_instance");
 
-    /* Initiate the connect sequence in libcouchbase */
-    if ((err = lcb_connect(*instancePtr)) != LCB_SUCCESS) {
+    /* Initiate the connect sequence in libcouchbase.  This resolves the
+       host synchronously, so let other threads run meanwhile */
+    Py_BEGIN_ALLOW_THREADS
+    err = lcb_connect(*instancePtr);
+    Py_END_ALLOW_THREADS
+    if (err != LCB_SUCCESS) {
         snprintf(errMsg, 256, "pylcb, failed to initiate connect: %s\n",
                  lcb_strerror(NULL, err));
         PyErr_SetString(PyExc_IOError, errMsg);
@@ -704,15 +3115,71 @@ pylcb_connect(PyObject *self, PyObject *args) {
 }
 
 
+static void
+connect_timeout_callback(evutil_socket_t sock, short which, void *arg)
+{
+    *(int *) arg = 1;
+}
+
+
+/* Block in the instance's libevent base until the connect started by
+   pylcb_connect got its configuration or an error, or until timeout
+   seconds passed.  A timer bounds the wait, so nothing spins and the
+   GIL is released throughout.  Returns False on timeout. */
+static PyObject *
+pylcb_wait_connect(PyObject *self, PyObject *args) {
+    PyObject *capsule;
+    double timeout;
+    lcb_t *instancePtr;
+    struct callbacks_node *node;
+    struct event_base *evbase;
+    struct event *timer;
+    struct timeval tv;
+    int timedOut = 0;
+
+    if (!PyArg_ParseTuple(args, "Od", &capsule, &timeout))
+        return NULL;
+    instancePtr = PyCapsule_GetPointer(capsule, "lcb_instance");
+    if (!instancePtr)
+        return NULL;
+
+    node = find_callbacks_node(*instancePtr);
+    if (!node) {
+        PyErr_SetString(PyExc_IOError, "pylcb, instance has no callbacks");
+        return NULL;
+    }
+    evbase = PyCapsule_GetPointer(node->io, "event_base");
+    if (!evbase)
+        return NULL;
+
+    timer = event_new(evbase, -1, 0, connect_timeout_callback, &timedOut);
+    if (!timer)
+        return PyErr_NoMemory();
+    tv.tv_sec = (long) timeout;
+    tv.tv_usec = (long) ((timeout - tv.tv_sec) * 1000000);
+    event_add(timer, &tv);
+
+    Py_BEGIN_ALLOW_THREADS
+    while (!node->connected && !timedOut) {
+        event_base_loop(evbase, EVLOOP_ONCE);
+    }
+    Py_END_ALLOW_THREADS
+
+    event_free(timer);
+    return PyBool_FromLong(node->connected);
+}
+
+
 static PyObject *
 pylcb_arithmetic(PyObject *self, PyObject *args) {
     PyObject *capsule;
-    void *cookie;
+    PyObject *cookie;
     char *key;
     int delta;
     int initial;
     int expiration;
     lcb_t *instancePtr;
+    struct callbacks_node *node;
 
     lcb_arithmetic_cmd_t cmd;
     const lcb_arithmetic_cmd_t *commands[1];
@@ -725,6 +3192,8 @@ pylcb_arithmetic(PyObject *self, PyObject *args) {
         return NULL;
     }
     instancePtr = PyCapsule_GetPointer(capsule, "lcb_instance");
+    node = find_callbacks_node(*instancePtr);
+    near_cache_invalidate(node, key, strlen(key));
 
     memset(&cmd, 0, sizeof(cmd));
     cmd.v.v0.key = key;
@@ -735,42 +3204,252 @@ pylcb_arithmetic(PyObject *self, PyObject *args) {
     cmd.v.v0.initial = initial;
     commands[0] = &cmd;
     
+    hold_cookie(cookie, 1);
     err = lcb_arithmetic(*instancePtr, cookie, 1, commands);
     if (err != LCB_SUCCESS) {
+        release_cookie(cookie, 1);
+        snprintf(errMsg, 256, "pylcb, failed to initiate arithmetic: %s\n",
+                 lcb_strerror(NULL, err));
+        PyErr_SetString(PyExc_IOError, errMsg);
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static PyObject *
+pylcb_arithmetic_multi(PyObject *self, PyObject *args) {
+    PyObject *capsule;
+    PyObject *cookie;
+    PyObject *items;
+    PyObject *seq;
+    Py_ssize_t nitems;
+    Py_ssize_t i;
+    char *key;
+    Py_ssize_t nkey;
+    PY_LONG_LONG delta;
+    unsigned PY_LONG_LONG initial;
+    int expiration;
+    lcb_t *instancePtr;
+    struct callbacks_node *node;
+
+    lcb_arithmetic_cmd_t *cmds;
+    const lcb_arithmetic_cmd_t **commands;
+
+    lcb_error_t err;
+    char errMsg[256];
+
+    if (!PyArg_ParseTuple(args, "OOO", &capsule, &cookie, &items)) {
+        return NULL;
+    }
+    instancePtr = PyCapsule_GetPointer(capsule, "lcb_instance");
+
+    seq = PySequence_Fast(items, "items must be a sequence");
+    if (!seq) {
+        return NULL;
+    }
+    nitems = PySequence_Fast_GET_SIZE(seq);
+    if (nitems == 0) {
+        Py_DECREF(seq);
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+
+    cmds = calloc(nitems, sizeof(lcb_arithmetic_cmd_t));
+    commands = calloc(nitems, sizeof(lcb_arithmetic_cmd_t *));
+    if (!cmds || !commands) {
+        free(cmds);
+        free(commands);
+        Py_DECREF(seq);
+        PyErr_SetString(PyExc_MemoryError,
+                        "ran out of memory while allocating arithmetic "
+                        "commands");
+        return NULL;
+    }
+
+    /* each item is a (key, delta, initial, expiration) tuple, the keys
+       are owned by seq */
+    node = find_callbacks_node(*instancePtr);
+    for (i = 0; i < nitems; i++) {
+        if (!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(seq, i), "s#LKi",
+                              &key, &nkey, &delta, &initial, &expiration)) {
+            free(cmds);
+            free(commands);
+            Py_DECREF(seq);
+            return NULL;
+        }
+        near_cache_invalidate(node, key, nkey);
+        cmds[i].v.v0.key = key;
+        cmds[i].v.v0.nkey = nkey;
+        cmds[i].v.v0.exptime = expiration;
+        cmds[i].v.v0.create = 1;
+        cmds[i].v.v0.delta = delta;
+        cmds[i].v.v0.initial = initial;
+        commands[i] = &cmds[i];
+    }
+
+    hold_cookie(cookie, nitems);
+    err = lcb_arithmetic(*instancePtr, cookie, nitems, commands);
+    free(cmds);
+    free(commands);
+    Py_DECREF(seq);
+    if (err != LCB_SUCCESS) {
+        release_cookie(cookie, nitems);
         snprintf(errMsg, 256, "pylcb, failed to initiate arithmetic: %s\n",
                  lcb_strerror(NULL, err));
         PyErr_SetString(PyExc_IOError, errMsg);
         return NULL;
     }
 
-    Py_INCREF(Py_None);
-    return Py_None;
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static PyObject *
+pylcb_flush(PyObject *self, PyObject *args) {
+    PyObject *capsule;
+    PyObject *cookie;
+    lcb_t *instancePtr;
+    struct callbacks_node *node;
+
+    lcb_flush_cmd_t cmd;
+    const lcb_flush_cmd_t *commands[1];
+
+    lcb_error_t err;
+    char errMsg[256];
+
+    if (!PyArg_ParseTuple(args, "OO", &capsule, &cookie)) {
+        return NULL;
+    }
+    instancePtr = PyCapsule_GetPointer(capsule, "lcb_instance");
+    node = find_callbacks_node(*instancePtr);
+    if (node && node->nearCache.capacity) {
+        near_cache_clear(&node->nearCache);
+    }
+    if (node && node->missCache.capacity) {
+        near_cache_clear(&node->missCache);
+    }
+
+    memset(&cmd, 0, sizeof(cmd));
+    commands[0] = &cmd;
+    
+    hold_cookie(cookie, 1);
+    err = lcb_flush(*instancePtr, cookie, 1, commands);
+    if (err != LCB_SUCCESS) {
+        release_cookie(cookie, 1);
+        snprintf(errMsg, 256, "pylcb, failed to initiate flush: %s\n",
+                 lcb_strerror(NULL, err));
+        PyErr_SetString(PyExc_IOError, errMsg);
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+/* deliver key from the near caches if they know it, returns 1 then.
+   A value is copied first, since the python code run by the delivery
+   may write the key and so drop the entry */
+static int
+deliver_near_cache_hit(struct callbacks_node *node, PyObject *cookie,
+                       const char *key, lcb_size_t nkey)
+{
+    struct near_entry *entry;
+    PyObject *bytes;
+    lcb_uint32_t flags;
+    lcb_cas_t cas;
+    int knownMissing;
+
+    if (!node) {
+        return 0;
+    }
+
+    /* a key known missing is answered by the miss cache alone, so the
+       near cache neither counts a miss nor holds a slot for it */
+    knownMissing = near_cache_peek(&node->missCache, key, nkey);
+    if (knownMissing &&
+        near_cache_lookup(&node->missCache, cookie, key, nkey)) {
+        deliver_get(node, cookie, LCB_KEY_ENOENT, key, nkey, NULL, 0, 0, 0);
+        return 1;
+    }
+
+    entry = near_cache_lookup(&node->nearCache, cookie, key, nkey);
+    if (entry) {
+        bytes = PyString_FromStringAndSize(entry->bytes, entry->nbytes);
+        if (!bytes) {
+            PyErr_Clear();
+            return 0;
+        }
+        flags = entry->flags;
+        cas = entry->cas;
+
+        deliver_get(node, cookie, LCB_SUCCESS, key, nkey,
+                    PyString_AS_STRING(bytes), PyString_GET_SIZE(bytes),
+                    flags, cas);
+        Py_DECREF(bytes);
+        return 1;
+    }
+
+    /* otherwise leave the miss cache a placeholder to fill, unless the
+       sampled lookup above already did */
+    if (!knownMissing) {
+        near_cache_lookup(&node->missCache, cookie, key, nkey);
+    }
+    return 0;
 }
 
 
 static PyObject *
-pylcb_flush(PyObject *self, PyObject *args) {
+pylcb_get(PyObject *self, PyObject *args) {
     PyObject *capsule;
-    void *cookie;
+    PyObject *cookie;
+    char *key = NULL;
+    Py_ssize_t nkey;
+    int expiration = 0;
+    int lock = 0;
     lcb_t *instancePtr;
+    struct callbacks_node *node;
 
-    lcb_flush_cmd_t cmd;
-    const lcb_flush_cmd_t *commands[1];
+    lcb_get_cmd_t cmd;
+    const lcb_get_cmd_t *commands[1];
 
     lcb_error_t err;
     char errMsg[256];
 
-    if (!PyArg_ParseTuple(args, "OO", &capsule, &cookie)) {
+    /* a non zero expiration also touches the item, or with lock set
+       locks it for that many seconds */
+    if (!PyArg_ParseTuple(args, "OOs#|ii", &capsule, &cookie, &key, &nkey,
+                          &expiration, &lock)) {
         return NULL;
     }
     instancePtr = PyCapsule_GetPointer(capsule, "lcb_instance");
 
-    memset(&cmd, 0, sizeof(cmd));
+    /* touching and locking gets have to reach the server, and change
+       the cas the cache holds */
+    node = find_callbacks_node(*instancePtr);
+    if (expiration || lock) {
+        near_cache_invalidate(node, key, nkey);
+    } else if (deliver_near_cache_hit(node, cookie, key, nkey)) {
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+
     commands[0] = &cmd;
-    
-    err = lcb_flush(*instancePtr, cookie, 1, commands);
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.v.v0.key = key;
+    cmd.v.v0.nkey = nkey;
+    cmd.v.v0.exptime = expiration;
+    cmd.v.v0.lock = lock;
+
+    hold_cookie(cookie, 1);
+    err = lcb_get(*instancePtr, cookie, 1, commands);
     if (err != LCB_SUCCESS) {
-        snprintf(errMsg, 256, "pylcb, failed to initiate flush: %s\n",
+        release_cookie(cookie, 1);
+        snprintf(errMsg, 256, "pylcb, failed to initiate get: %s\n",
                  lcb_strerror(NULL, err));
         PyErr_SetString(PyExc_IOError, errMsg);
         return NULL;
@@ -782,30 +3461,83 @@ pylcb_flush(PyObject *self, PyObject *args) {
 
 
 static PyObject *
-pylcb_get(PyObject *self, PyObject *args) {
+pylcb_get_multi(PyObject *self, PyObject *args) {
     PyObject *capsule;
-    void *cookie;
-    char *key = NULL;
+    PyObject *cookie;
+    PyObject *keys;
+    PyObject *seq;
+    Py_ssize_t nkeys;
+    Py_ssize_t ncmds;
+    Py_ssize_t i;
+    char *key;
+    Py_ssize_t nkey;
     lcb_t *instancePtr;
+    struct callbacks_node *node;
 
-    lcb_get_cmd_t cmd;
-    const lcb_get_cmd_t *commands[1];
+    lcb_get_cmd_t *cmds;
+    const lcb_get_cmd_t **commands;
 
     lcb_error_t err;
     char errMsg[256];
 
-    if (!PyArg_ParseTuple(args, "OOs", &capsule, &cookie, &key)) {
+    if (!PyArg_ParseTuple(args, "OOO", &capsule, &cookie, &keys)) {
         return NULL;
     }
     instancePtr = PyCapsule_GetPointer(capsule, "lcb_instance");
 
-    commands[0] = &cmd;
-    memset(&cmd, 0, sizeof(cmd));
-    cmd.v.v0.key = key;
-    cmd.v.v0.nkey = strlen(key);
+    seq = PySequence_Fast(keys, "keys must be a sequence");
+    if (!seq) {
+        return NULL;
+    }
+    nkeys = PySequence_Fast_GET_SIZE(seq);
+    if (nkeys == 0) {
+        Py_DECREF(seq);
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
 
-    err = lcb_get(*instancePtr, cookie, 1, commands);
+    cmds = calloc(nkeys, sizeof(lcb_get_cmd_t));
+    commands = calloc(nkeys, sizeof(lcb_get_cmd_t *));
+    if (!cmds || !commands) {
+        free(cmds);
+        free(commands);
+        Py_DECREF(seq);
+        PyErr_SetString(PyExc_MemoryError,
+                        "ran out of memory while allocating get commands");
+        return NULL;
+    }
+
+    /* the key buffers are owned by seq, which outlives lcb_get.  Keys
+       in the near cache are delivered right away and not sent */
+    node = find_callbacks_node(*instancePtr);
+    ncmds = 0;
+    for (i = 0; i < nkeys; i++) {
+        if (PyString_AsStringAndSize(PySequence_Fast_GET_ITEM(seq, i),
+                                     &key, &nkey) < 0) {
+            free(cmds);
+            free(commands);
+            Py_DECREF(seq);
+            return NULL;
+        }
+        if (deliver_near_cache_hit(node, cookie, key, nkey)) {
+            continue;
+        }
+        cmds[ncmds].v.v0.key = key;
+        cmds[ncmds].v.v0.nkey = nkey;
+        commands[ncmds] = &cmds[ncmds];
+        ncmds++;
+    }
+
+    err = LCB_SUCCESS;
+    if (ncmds > 0) {
+        hold_cookie(cookie, ncmds);
+        err = lcb_get(*instancePtr, cookie, ncmds, commands);
+    }
+    free(cmds);
+    free(commands);
+    Py_DECREF(seq);
     if (err != LCB_SUCCESS) {
+        release_cookie(cookie, ncmds);
         snprintf(errMsg, 256, "pylcb, failed to initiate get: %s\n",
                  lcb_strerror(NULL, err));
         PyErr_SetString(PyExc_IOError, errMsg);
@@ -820,7 +3552,7 @@ pylcb_get(PyObject *self, PyObject *args) {
 static PyObject *
 pylcb_make_http_request(PyObject *self, PyObject *args) {
     PyObject *capsule;
-    void *cookie;
+    PyObject *cookie;
     lcb_http_type_t type;
     char *path;
     char *body;
@@ -850,13 +3582,122 @@ pylcb_make_http_request(PyObject *self, PyObject *args) {
     cmd.v.v0.chunked = chunked;
     cmd.v.v0.content_type = content_type;
 
+    hold_cookie(cookie, 1);
     err = lcb_make_http_request(*instancePtr, cookie, type, &cmd, &req);
     if (err != LCB_SUCCESS) {
+        release_cookie(cookie, 1);
         snprintf(errMsg, 256, "pylcb, failed to make http request: %s\n",
                  lcb_strerror(NULL, err));
         PyErr_SetString(PyExc_IOError, errMsg);
         return NULL;
     }
+    /* kept so a stream whose reader went away can be cancelled */
+    if (PyObject_TypeCheck(cookie, &RowStreamType)) {
+        ((struct row_stream *) cookie)->request = req;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+/* stop a streaming request that has not completed.  libcouchbase calls
+   no callback for it afterwards, so the cookie is released here */
+static PyObject *
+pylcb_cancel_http_request(PyObject *self, PyObject *args) {
+    PyObject *capsule;
+    struct row_stream *stream;
+    lcb_t *instancePtr;
+
+    if (!PyArg_ParseTuple(args, "OO!", &capsule, &RowStreamType, &stream)) {
+        return NULL;
+    }
+    instancePtr = PyCapsule_GetPointer(capsule, "lcb_instance");
+
+    if (stream->request && !stream->done) {
+        lcb_cancel_http_request(*instancePtr, stream->request);
+        stream->request = NULL;
+        stream->done = 1;
+        release_cookie((PyObject *) stream, 1);
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static PyObject *
+pylcb_observe(PyObject *self, PyObject *args) {
+    PyObject *capsule;
+    PyObject *cookie;
+    PyObject *keys;
+    PyObject *seq;
+    Py_ssize_t nkeys;
+    Py_ssize_t i;
+    char *key;
+    Py_ssize_t nkey;
+    lcb_t *instancePtr;
+
+    lcb_observe_cmd_t *cmds;
+    const lcb_observe_cmd_t **commands;
+
+    lcb_error_t err;
+    char errMsg[256];
+
+    if (!PyArg_ParseTuple(args, "OOO", &capsule, &cookie, &keys)) {
+        return NULL;
+    }
+    instancePtr = PyCapsule_GetPointer(capsule, "lcb_instance");
+
+    seq = PySequence_Fast(keys, "keys must be a sequence");
+    if (!seq) {
+        return NULL;
+    }
+    nkeys = PySequence_Fast_GET_SIZE(seq);
+    if (nkeys == 0) {
+        Py_DECREF(seq);
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+
+    cmds = calloc(nkeys, sizeof(lcb_observe_cmd_t));
+    commands = calloc(nkeys, sizeof(lcb_observe_cmd_t *));
+    if (!cmds || !commands) {
+        free(cmds);
+        free(commands);
+        Py_DECREF(seq);
+        PyErr_SetString(PyExc_MemoryError,
+                        "ran out of memory while allocating observe commands");
+        return NULL;
+    }
+
+    for (i = 0; i < nkeys; i++) {
+        if (PyString_AsStringAndSize(PySequence_Fast_GET_ITEM(seq, i),
+                                     &key, &nkey) < 0) {
+            free(cmds);
+            free(commands);
+            Py_DECREF(seq);
+            return NULL;
+        }
+        cmds[i].v.v0.key = key;
+        cmds[i].v.v0.nkey = nkey;
+        commands[i] = &cmds[i];
+    }
+
+    /* one cookie reference for the whole call, released by the final
+       observe_callback */
+    hold_cookie(cookie, 1);
+    err = lcb_observe(*instancePtr, cookie, nkeys, commands);
+    free(cmds);
+    free(commands);
+    Py_DECREF(seq);
+    if (err != LCB_SUCCESS) {
+        release_cookie(cookie, 1);
+        snprintf(errMsg, 256, "pylcb, failed to observe: %s\n",
+                 lcb_strerror(NULL, err));
+        PyErr_SetString(PyExc_IOError, errMsg);
+        return NULL;
+    }
 
     Py_INCREF(Py_None);
     return Py_None;
@@ -866,9 +3707,11 @@ pylcb_make_http_request(PyObject *self, PyObject *args) {
 static PyObject *
 pylcb_remove(PyObject *self, PyObject *args) {
     PyObject *capsule;
-    void *cookie;
+    PyObject *cookie;
     char *key;
+    unsigned PY_LONG_LONG cas = 0;
     lcb_t *instancePtr;
+    struct callbacks_node *node;
 
     lcb_remove_cmd_t cmd;
     const lcb_remove_cmd_t *commands[1];
@@ -876,18 +3719,23 @@ pylcb_remove(PyObject *self, PyObject *args) {
     lcb_error_t err;
     char errMsg[256];
 
-    if (!PyArg_ParseTuple(args, "OOs", &capsule, &cookie, &key)) {
+    if (!PyArg_ParseTuple(args, "OOs|K", &capsule, &cookie, &key, &cas)) {
         return NULL;
     }
     instancePtr = PyCapsule_GetPointer(capsule, "lcb_instance");
+    node = find_callbacks_node(*instancePtr);
+    near_cache_invalidate(node, key, strlen(key));
 
     memset(&cmd, 0, sizeof(cmd));
     cmd.v.v0.key = key;
     cmd.v.v0.nkey = strlen(key);
+    cmd.v.v0.cas = cas;
     commands[0] = &cmd;
     
+    hold_cookie(cookie, 1);
     err = lcb_remove(*instancePtr, cookie, 1, commands);
     if (err != LCB_SUCCESS) {
+        release_cookie(cookie, 1);
         snprintf(errMsg, 256, "pylcb, failed to remove: %s\n",
                  lcb_strerror(NULL, err));
         PyErr_SetString(PyExc_IOError, errMsg);
@@ -902,7 +3750,7 @@ pylcb_remove(PyObject *self, PyObject *args) {
 static PyObject *
 pylcb_stats(PyObject *self, PyObject *args) {
     PyObject *capsule;
-    void *cookie;
+    PyObject *cookie;
     char *name;
     lcb_t *instancePtr;
 
@@ -922,8 +3770,10 @@ pylcb_stats(PyObject *self, PyObject *args) {
     cmd.v.v0.nname = strlen(name);
     commands[0] = &cmd;
 
+    hold_cookie(cookie, 1);
     err = lcb_server_stats(*instancePtr, cookie, 1, commands);
     if (err != LCB_SUCCESS) {
+        release_cookie(cookie, 1);
         snprintf(errMsg, 256, "pylcb, failed to get stats: %s\n",
                  lcb_strerror(NULL, err));
         PyErr_SetString(PyExc_IOError, errMsg);
@@ -938,13 +3788,19 @@ pylcb_stats(PyObject *self, PyObject *args) {
 static PyObject *
 pylcb_store(PyObject *self, PyObject *args) {
     PyObject *capsule;
-    void *cookie;
+    PyObject *cookie;
     char *key;
+    Py_ssize_t nkey;
     int expiration;
-    int flags;
-    char *value;
+    unsigned int flags;
+    PyObject *object;
+    Py_buffer value;
     int operation;
+    unsigned PY_LONG_LONG cas = 0;
     lcb_t *instancePtr;
+    struct callbacks_node *node;
+    char *compressed;
+    lcb_size_t ncompressed;
 
     lcb_store_cmd_t cmd;
     const lcb_store_cmd_t *commands[1];
@@ -952,24 +3808,162 @@ pylcb_store(PyObject *self, PyObject *args) {
     lcb_error_t err;
     char errMsg[256];
 
-    if (!PyArg_ParseTuple(args, "OOsiisi", &capsule, &cookie, &key, 
-                          &expiration, &flags, &value, &operation)) {
+    /* the value is encoded by the instance's transcoder.  Buffer objects
+       (str, bytearray, memoryview) are stored as they are, and lcb_store
+       copies them into the output buffer, so they are only borrowed for
+       the duration of the call.  A non zero cas makes the store fail
+       with LCB_KEY_EEXISTS when the item changed since it was read */
+    if (!PyArg_ParseTuple(args, "OOs#iIOi|K", &capsule, &cookie, &key, &nkey,
+                          &expiration, &flags, &object, &operation, &cas)) {
         return NULL;
     }
     instancePtr = PyCapsule_GetPointer(capsule, "lcb_instance");
+    node = find_callbacks_node(*instancePtr);
+    near_cache_invalidate(node, key, nkey);
+    if (encode_value(node, object, &flags, &value) < 0) {
+        return NULL;
+    }
+    if (compress_value(node, operation, &value, &flags,
+                       &compressed, &ncompressed) < 0) {
+        PyBuffer_Release(&value);
+        return NULL;
+    }
 
     memset(&cmd, 0, sizeof(cmd));
     cmd.v.v0.key = key;
-    cmd.v.v0.nkey = strlen(key);
-    cmd.v.v0.bytes = value;
-    cmd.v.v0.nbytes = strlen(value);
+    cmd.v.v0.nkey = nkey;
+    if (compressed) {
+        cmd.v.v0.bytes = compressed;
+        cmd.v.v0.nbytes = ncompressed;
+    } else {
+        cmd.v.v0.bytes = value.buf;
+        cmd.v.v0.nbytes = value.len;
+    }
     cmd.v.v0.operation = operation;
     cmd.v.v0.exptime = expiration;
     cmd.v.v0.flags = flags;
+    cmd.v.v0.cas = cas;
     commands[0] = &cmd;
-    
+
+    hold_cookie(cookie, 1);
     err = lcb_store(*instancePtr, cookie, 1, commands);
+    PyBuffer_Release(&value);
+    free(compressed);
+    if (err != LCB_SUCCESS) {
+        release_cookie(cookie, 1);
+        snprintf(errMsg, 256, "pylcb, failed to store: %s\n",
+                 lcb_strerror(NULL, err));
+        PyErr_SetString(PyExc_IOError, errMsg);
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static PyObject *
+pylcb_store_multi(PyObject *self, PyObject *args) {
+    PyObject *capsule;
+    PyObject *cookie;
+    PyObject *items;
+    PyObject *seq;
+    Py_ssize_t nitems;
+    Py_ssize_t i;
+    char *key;
+    Py_ssize_t nkey;
+    int expiration;
+    unsigned int flags;
+    PyObject *object;
+    Py_buffer *values;
+    char **compressed;
+    lcb_size_t ncompressed;
+    int operation;
+    lcb_t *instancePtr;
+    struct callbacks_node *node;
+
+    lcb_store_cmd_t *cmds;
+    const lcb_store_cmd_t **commands;
+
+    lcb_error_t err;
+    char errMsg[256];
+
+    if (!PyArg_ParseTuple(args, "OOOi", &capsule, &cookie, &items,
+                          &operation)) {
+        return NULL;
+    }
+    instancePtr = PyCapsule_GetPointer(capsule, "lcb_instance");
+
+    seq = PySequence_Fast(items, "items must be a sequence");
+    if (!seq) {
+        return NULL;
+    }
+    nitems = PySequence_Fast_GET_SIZE(seq);
+    if (nitems == 0) {
+        Py_DECREF(seq);
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+
+    cmds = calloc(nitems, sizeof(lcb_store_cmd_t));
+    commands = calloc(nitems, sizeof(lcb_store_cmd_t *));
+    values = calloc(nitems, sizeof(Py_buffer));
+    compressed = calloc(nitems, sizeof(char *));
+    if (!cmds || !commands || !values || !compressed) {
+        free(cmds);
+        free(commands);
+        free(values);
+        free(compressed);
+        Py_DECREF(seq);
+        PyErr_SetString(PyExc_MemoryError,
+                        "ran out of memory while allocating store commands");
+        return NULL;
+    }
+
+    /* each item is a (key, expiration, flags, value) tuple.  The keys
+       are owned by seq and the encoded values are held until lcb_store
+       has copied them */
+    node = find_callbacks_node(*instancePtr);
+    for (i = 0; i < nitems; i++) {
+        if (!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(seq, i), "s#iIO",
+                              &key, &nkey, &expiration, &flags, &object) ||
+            encode_value(node, object, &flags, &values[i]) < 0) {
+            goto fail;
+        }
+        near_cache_invalidate(node, key, nkey);
+        if (compress_value(node, operation, &values[i], &flags,
+                           &compressed[i], &ncompressed) < 0) {
+            PyBuffer_Release(&values[i]);
+            goto fail;
+        }
+        cmds[i].v.v0.key = key;
+        cmds[i].v.v0.nkey = nkey;
+        if (compressed[i]) {
+            cmds[i].v.v0.bytes = compressed[i];
+            cmds[i].v.v0.nbytes = ncompressed;
+        } else {
+            cmds[i].v.v0.bytes = values[i].buf;
+            cmds[i].v.v0.nbytes = values[i].len;
+        }
+        cmds[i].v.v0.operation = operation;
+        cmds[i].v.v0.exptime = expiration;
+        cmds[i].v.v0.flags = flags;
+        commands[i] = &cmds[i];
+    }
+
+    hold_cookie(cookie, nitems);
+    err = lcb_store(*instancePtr, cookie, nitems, commands);
+    for (i = 0; i < nitems; i++) {
+        PyBuffer_Release(&values[i]);
+        free(compressed[i]);
+    }
+    free(cmds);
+    free(commands);
+    free(values);
+    free(compressed);
+    Py_DECREF(seq);
     if (err != LCB_SUCCESS) {
+        release_cookie(cookie, nitems);
         snprintf(errMsg, 256, "pylcb, failed to store: %s\n",
                  lcb_strerror(NULL, err));
         PyErr_SetString(PyExc_IOError, errMsg);
@@ -978,6 +3972,18 @@ pylcb_store(PyObject *self, PyObject *args) {
 
     Py_INCREF(Py_None);
     return Py_None;
+
+fail:
+    while (i-- > 0) {
+        PyBuffer_Release(&values[i]);
+        free(compressed[i]);
+    }
+    free(cmds);
+    free(commands);
+    free(values);
+    free(compressed);
+    Py_DECREF(seq);
+    return NULL;
 }
 
 
@@ -992,6 +3998,130 @@ pylcb_strerror(PyObject *self, PyObject *args) {
 }
 
 
+static PyObject *
+pylcb_touch(PyObject *self, PyObject *args) {
+    PyObject *capsule;
+    PyObject *cookie;
+    PyObject *keys;
+    PyObject *seq;
+    int expiration;
+    Py_ssize_t nkeys;
+    Py_ssize_t i;
+    char *key;
+    Py_ssize_t nkey;
+    lcb_t *instancePtr;
+    struct callbacks_node *node;
+
+    lcb_touch_cmd_t *cmds;
+    const lcb_touch_cmd_t **commands;
+
+    lcb_error_t err;
+    char errMsg[256];
+
+    if (!PyArg_ParseTuple(args, "OOOi", &capsule, &cookie, &keys,
+                          &expiration)) {
+        return NULL;
+    }
+    instancePtr = PyCapsule_GetPointer(capsule, "lcb_instance");
+
+    seq = PySequence_Fast(keys, "keys must be a sequence");
+    if (!seq) {
+        return NULL;
+    }
+    nkeys = PySequence_Fast_GET_SIZE(seq);
+    if (nkeys == 0) {
+        Py_DECREF(seq);
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+
+    cmds = calloc(nkeys, sizeof(lcb_touch_cmd_t));
+    commands = calloc(nkeys, sizeof(lcb_touch_cmd_t *));
+    if (!cmds || !commands) {
+        free(cmds);
+        free(commands);
+        Py_DECREF(seq);
+        PyErr_SetString(PyExc_MemoryError,
+                        "ran out of memory while allocating touch commands");
+        return NULL;
+    }
+
+    node = find_callbacks_node(*instancePtr);
+    for (i = 0; i < nkeys; i++) {
+        if (PyString_AsStringAndSize(PySequence_Fast_GET_ITEM(seq, i),
+                                     &key, &nkey) < 0) {
+            free(cmds);
+            free(commands);
+            Py_DECREF(seq);
+            return NULL;
+        }
+        cmds[i].v.v0.key = key;
+        cmds[i].v.v0.nkey = nkey;
+        cmds[i].v.v0.exptime = expiration;
+        near_cache_invalidate(node, key, nkey);
+        commands[i] = &cmds[i];
+    }
+
+    hold_cookie(cookie, nkeys);
+    err = lcb_touch(*instancePtr, cookie, nkeys, commands);
+    free(cmds);
+    free(commands);
+    Py_DECREF(seq);
+    if (err != LCB_SUCCESS) {
+        release_cookie(cookie, nkeys);
+        snprintf(errMsg, 256, "pylcb, failed to touch: %s\n",
+                 lcb_strerror(NULL, err));
+        PyErr_SetString(PyExc_IOError, errMsg);
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static PyObject *
+pylcb_unlock(PyObject *self, PyObject *args) {
+    PyObject *capsule;
+    PyObject *cookie;
+    char *key;
+    Py_ssize_t nkey;
+    unsigned PY_LONG_LONG cas;
+    lcb_t *instancePtr;
+
+    lcb_unlock_cmd_t cmd;
+    const lcb_unlock_cmd_t *commands[1];
+
+    lcb_error_t err;
+    char errMsg[256];
+
+    if (!PyArg_ParseTuple(args, "OOs#K", &capsule, &cookie, &key, &nkey,
+                          &cas)) {
+        return NULL;
+    }
+    instancePtr = PyCapsule_GetPointer(capsule, "lcb_instance");
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.v.v0.key = key;
+    cmd.v.v0.nkey = nkey;
+    cmd.v.v0.cas = cas;
+    commands[0] = &cmd;
+
+    hold_cookie(cookie, 1);
+    err = lcb_unlock(*instancePtr, cookie, 1, commands);
+    if (err != LCB_SUCCESS) {
+        release_cookie(cookie, 1);
+        snprintf(errMsg, 256, "pylcb, failed to unlock: %s\n",
+                 lcb_strerror(NULL, err));
+        PyErr_SetString(PyExc_IOError, errMsg);
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
 static PyObject *
 pylcb_wait(PyObject *self, PyObject *args) {
     PyObject *capsule;
@@ -1001,7 +4131,58 @@ pylcb_wait(PyObject *self, PyObject *args) {
         return NULL;
     instancePtr = PyCapsule_GetPointer(capsule, "lcb_instance");
 
+    Py_BEGIN_ALLOW_THREADS
     lcb_wait(*instancePtr);
+    Py_END_ALLOW_THREADS
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+/* Wait for the pending operations of several instances. Instances that
+   share an event base are all driven by whichever lcb_wait is running, so
+   the whole call takes as long as the slowest instance, and the GIL is
+   only released once. */
+static PyObject *
+pylcb_wait_multi(PyObject *self, PyObject *args) {
+    PyObject *instances;
+    PyObject *seq;
+    lcb_t **instancePtrs;
+    Py_ssize_t ii, count;
+
+    if (!PyArg_ParseTuple(args, "O", &instances))
+        return NULL;
+
+    seq = PySequence_Fast(instances, "instances must be a sequence");
+    if (!seq)
+        return NULL;
+    count = PySequence_Fast_GET_SIZE(seq);
+
+    instancePtrs = calloc(count ? count : 1, sizeof(lcb_t *));
+    if (!instancePtrs) {
+        Py_DECREF(seq);
+        return PyErr_NoMemory();
+    }
+    for (ii = 0; ii < count; ii++) {
+        instancePtrs[ii] = PyCapsule_GetPointer(
+                PySequence_Fast_GET_ITEM(seq, ii), "lcb_instance");
+        if (!instancePtrs[ii]) {
+            free(instancePtrs);
+            Py_DECREF(seq);
+            return NULL;
+        }
+    }
+
+    /* the capsules in seq keep the instances alive while unlocked */
+    Py_BEGIN_ALLOW_THREADS
+    for (ii = 0; ii < count; ii++) {
+        lcb_wait(*instancePtrs[ii]);
+    }
+    Py_END_ALLOW_THREADS
+
+    free(instancePtrs);
+    Py_DECREF(seq);
 
     Py_INCREF(Py_None);
     return Py_None;
@@ -1043,28 +4224,70 @@ LcbMethods[] = {
       "Create an instance used to connect to Couchbase" },
     { "connect", pylcb_connect, METH_VARARGS,
       "Connect to Couchbase" },
+    { "wait_connect", pylcb_wait_connect, METH_VARARGS,
+      "Wait for a connect to complete, with a timeout in seconds" },
     { "arithmetic", pylcb_arithmetic, METH_VARARGS,
       "Add to or subtract from a numeric key" },
+    { "arithmetic_multi", pylcb_arithmetic_multi, METH_VARARGS,
+      "Add to or subtract from many numeric keys at once" },
     { "flush", pylcb_flush, METH_VARARGS,
       "Flush a bucket" },
     { "get", pylcb_get, METH_VARARGS,
       "Get a key" },
+    { "get_multi", pylcb_get_multi, METH_VARARGS,
+      "Get many keys with a single lcb_get call" },
     { "make_http_request", pylcb_make_http_request, METH_VARARGS,
       "make an http request" },
+    { "cancel_http_request", pylcb_cancel_http_request, METH_VARARGS,
+      "Cancel the streaming request of a RowStream that is not done" },
+    { "observe", pylcb_observe, METH_VARARGS,
+      "Ask every server for the state of many keys" },
     { "remove", pylcb_remove, METH_VARARGS,
       "Remove a key" },
     { "stats", pylcb_stats, METH_VARARGS,
       "Get stats from Couchbase cluster" },
     { "store", pylcb_store, METH_VARARGS,
       "Store a key" },
+    { "store_multi", pylcb_store_multi, METH_VARARGS,
+      "Store many keys with a single lcb_store call" },
     { "strerror", pylcb_strerror, METH_VARARGS,
       "Return the string representation of an error" },
+    { "touch", pylcb_touch, METH_VARARGS,
+      "Set a new expiration on many keys with a single lcb_touch call" },
+    { "unlock", pylcb_unlock, METH_VARARGS,
+      "Unlock a key locked by a get with lock" },
     { "wait", pylcb_wait, METH_VARARGS,
       "wait for couchbase call to complete" },
+    { "wait_multi", pylcb_wait_multi, METH_VARARGS,
+      "wait for the calls of several instances to complete" },
+    { "set_transcoder", pylcb_set_transcoder, METH_VARARGS,
+      "Set the object that encodes and decodes the values of an instance" },
+    { "encode_value", pylcb_encode_value, METH_VARARGS,
+      "Encode a value with the native transcoder" },
+    { "decode_value", pylcb_decode_value, METH_VARARGS,
+      "Decode a value with the native transcoder" },
+    { "set_compression", pylcb_set_compression, METH_VARARGS,
+      "Compress stored values of at least a size with zlib" },
+    { "compression_stats", pylcb_compression_stats, METH_VARARGS,
+      "Return the compression counters of an instance" },
+    { "set_near_cache", pylcb_set_near_cache, METH_VARARGS,
+      "Serve gets from a bounded in-process cache for up to ttl seconds" },
+    { "near_cache_stats", pylcb_near_cache_stats, METH_VARARGS,
+      "Return the near cache counters of an instance" },
+    { "set_miss_cache", pylcb_set_miss_cache, METH_VARARGS,
+      "Fail gets of keys recently found missing without a round trip" },
+    { "miss_cache_stats", pylcb_miss_cache_stats, METH_VARARGS,
+      "Return the miss cache counters of an instance" },
+    { "forget_cached", pylcb_forget_cached, METH_VARARGS,
+      "Drop a key from the near and miss caches of an instance" },
     { "create_event_base", pylcb_create_event_base, METH_VARARGS,
       "creates a libevent event base" },
     { "run_event_loop_nonblock", pylcb_run_event_loop_nonblock, METH_VARARGS,
       "run libevent event loop nonblocking" },
+    { "run_event_loop_once", pylcb_run_event_loop_once, METH_VARARGS,
+      "run libevent event loop until one event was handled" },
+    { "create_io_ops", pylcb_create_io_ops, METH_VARARGS,
+      "creates io ops that run on a python reactor" },
     { "get_timeout", pylcb_get_timeout, METH_VARARGS,
       "get libcouchbase operation timeout" },
     { "set_timeout", pylcb_set_timeout, METH_VARARGS,
@@ -1081,12 +4304,20 @@ LcbMethods[] = {
       "Set callback for lcb_get"},
     { "set_http_complete_callback", pylcb_set_http_complete_callback, METH_VARARGS,
       "Set callback for lcb_make_http_request"},
+    { "set_http_data_callback", pylcb_set_http_data_callback, METH_VARARGS,
+      "Set callback for chunks of a chunked lcb_make_http_request"},
+    { "set_observe_callback", pylcb_set_observe_callback, METH_VARARGS,
+      "Set callback for lcb_observe"},
     { "set_remove_callback", pylcb_set_remove_callback, METH_VARARGS,
       "Set callback for lcb_remove"},
     { "set_stat_callback", pylcb_set_stat_callback, METH_VARARGS,
       "Set callback for lcb_server_stats"},
     { "set_store_callback", pylcb_set_store_callback, METH_VARARGS,
       "Set callback for lcb_store"},
+    { "set_touch_callback", pylcb_set_touch_callback, METH_VARARGS,
+      "Set callback for lcb_touch"},
+    { "set_unlock_callback", pylcb_set_unlock_callback, METH_VARARGS,
+      "Set callback for lcb_unlock"},
     { NULL, NULL, 0, NULL }
 };
 
@@ -1094,7 +4325,42 @@ LcbMethods[] = {
 PyMODINIT_FUNC
 initpylcb(void)
 {
-    (void) Py_InitModule("pylcb", LcbMethods);
+    PyObject *module;
+
+    /* callbacks re-acquire the GIL with PyGILState_Ensure, which needs
+       the interpreter's thread support initialised */
+    PyEval_InitThreads();
+    module = Py_InitModule("pylcb", LcbMethods);
+    if (!module) {
+        return;
+    }
+    if (init_transcoding() < 0) {
+        return;
+    }
+
+    PyStructSequence_InitType(&ResultType, &result_desc);
+    Py_INCREF(&ResultType);
+    PyModule_AddObject(module, "Result", (PyObject *) &ResultType);
+
+    PyStructSequence_InitType(&HttpResultType, &http_result_desc);
+    Py_INCREF(&HttpResultType);
+    PyModule_AddObject(module, "HttpResult", (PyObject *) &HttpResultType);
+
+    if (PyType_Ready(&RowStreamType) < 0) {
+        return;
+    }
+    Py_INCREF(&RowStreamType);
+    PyModule_AddObject(module, "RowStream", (PyObject *) &RowStreamType);
+
+    PyStructSequence_InitType(&ServerResultType, &server_result_desc);
+    Py_INCREF(&ServerResultType);
+    PyModule_AddObject(module, "ServerResult",
+                       (PyObject *) &ServerResultType);
+
+    PyStructSequence_InitType(&ObserveResultType, &observe_result_desc);
+    Py_INCREF(&ObserveResultType);
+    PyModule_AddObject(module, "ObserveResult",
+                       (PyObject *) &ObserveResultType);
 }
 
 